@@ -0,0 +1,4 @@
+/* Workaround build system bug that will put objects in source dir */
+#if defined(CONFIG_NUS_CLIENT_HANDLE_CACHE)
+#include "../../gatt/nus_cache.c"
+#endif
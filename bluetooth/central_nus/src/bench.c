@@ -0,0 +1,408 @@
+/** @file
+ *  @brief Nordic NUS central benchmark driver
+ *
+ *  Drives the benchmark responder of the peripheral NUS sample over the
+ *  first link that gets subscribed. For every connection interval and
+ *  payload size of the sweep it synchronizes the clocks of both sides with
+ *  a few PINGs, has the peripheral stream DATA frames and prints one
+ *  machine readable "NUS_BENCH {...}" line; "NUS_BENCH_DONE" ends the
+ *  sweep.
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#if defined(CONFIG_NUS_BENCH)
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <misc/printk.h>
+#include <misc/byteorder.h>
+#include <zephyr.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
+
+#include <gatt/nus_bench.h>
+#include <gatt/nus_client.h>
+
+#include "bench.h"
+
+/* PINGs used to estimate the clock offset before each run */
+#define BENCH_SYNC_PINGS	8
+#define BENCH_PING_TIMEOUT	K_MSEC(500)
+/* How long DONE may take to arrive after the run should have ended */
+#define BENCH_DONE_GRACE_MS	2000
+#define BENCH_SWEEP_MAX		8
+
+enum {
+	BENCH_IDLE,
+	BENCH_SYNC,
+	BENCH_RUN,
+};
+
+/* Results of a single run. Updated from the BT RX thread, read by the
+ * driver thread once the run has ended.
+ */
+struct bench_run {
+	u8_t state;
+	u8_t ping_pending;
+	u16_t ping_seq;
+	/* Peripheral clock minus central clock, from the best PING */
+	s32_t offset_us;
+	u32_t best_rtt_us;
+	u32_t start_us;
+	u32_t first_us;
+	u32_t last_us;
+	u32_t frames;
+	u32_t bytes;
+	u16_t frame_len;
+	u8_t done;
+	u32_t done_frames;
+	struct nus_bench_hist owl;
+	struct nus_bench_hist rtt;
+};
+
+/* Referenced from bench_start() until the sweep has ended */
+static struct bt_conn *bench_conn;
+static u8_t bench_lost;
+static struct bench_run run;
+
+static K_SEM_DEFINE(bench_start_sem, 0, 1);
+static K_SEM_DEFINE(bench_pong_sem, 0, 1);
+static K_SEM_DEFINE(bench_done_sem, 0, 1);
+static K_SEM_DEFINE(bench_param_sem, 0, 1);
+
+void bench_start(struct bt_conn *conn)
+{
+	/* A single sweep per boot */
+	if (bench_conn || bench_lost) {
+		return;
+	}
+
+	bench_conn = bt_conn_ref(conn);
+
+	k_sem_give(&bench_start_sem);
+}
+
+static void bench_pong(const struct nus_bench_pong *pong, u32_t now)
+{
+	u32_t t1 = sys_le32_to_cpu(pong->ping_time_us);
+	u32_t t2 = sys_le32_to_cpu(pong->rx_time_us);
+	u32_t t3 = sys_le32_to_cpu(pong->hdr.time_us);
+	u32_t rtt;
+
+	if (!run.ping_pending ||
+	    sys_le16_to_cpu(pong->hdr.seq) != run.ping_seq) {
+		return;
+	}
+
+	run.ping_pending = 0;
+
+	/* Time on air both ways, without the turnaround of the peripheral */
+	rtt = (now - t1) - (t3 - t2);
+	nus_bench_hist_add(&run.rtt, rtt);
+
+	if (rtt < run.best_rtt_us) {
+		run.best_rtt_us = rtt;
+		run.offset_us = ((s32_t)(t2 - t1) + (s32_t)(t3 - now)) / 2;
+	}
+
+	k_sem_give(&bench_pong_sem);
+}
+
+static void bench_data(const struct nus_bench_hdr *hdr, u16_t len, u32_t now)
+{
+	u32_t sent = sys_le32_to_cpu(hdr->time_us) - run.offset_us;
+
+	if (!run.frames) {
+		run.first_us = now;
+		run.frame_len = len;
+	}
+
+	run.last_us = now;
+	run.frames++;
+	run.bytes += len;
+
+	nus_bench_hist_add(&run.owl, now - sent);
+}
+
+bool bench_notify(struct bt_conn *conn, const void *data, u16_t len)
+{
+	u32_t now = nus_bench_time_us();
+	const struct nus_bench_done *done = data;
+
+	if (conn != bench_conn) {
+		return false;
+	}
+
+	switch (nus_bench_type(data, len)) {
+	case 0:
+		return false;
+	case NUS_BENCH_PONG:
+		if (len >= sizeof(struct nus_bench_pong)) {
+			bench_pong(data, now);
+		}
+		break;
+	case NUS_BENCH_DATA:
+		if (run.state == BENCH_RUN && !run.done) {
+			bench_data(data, len, now);
+		}
+		break;
+	case NUS_BENCH_DONE:
+		if (run.state == BENCH_RUN && len >= sizeof(*done)) {
+			run.done_frames = sys_le32_to_cpu(done->frames);
+			run.done = 1;
+			k_sem_give(&bench_done_sem);
+		}
+		break;
+	}
+
+	return true;
+}
+
+static int bench_write(struct bt_conn *conn, const void *data, u16_t len)
+{
+	s32_t ret;
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		ret = nus_client_send(conn, data, len);
+		if (ret != -ENOMEM && ret != -EAGAIN) {
+			break;
+		}
+
+		k_sleep(K_MSEC(10));
+	}
+
+	return ret < 0 ? ret : 0;
+}
+
+static int bench_ping(struct bt_conn *conn)
+{
+	struct nus_bench_hdr ping;
+
+	run.ping_seq++;
+	run.ping_pending = 1;
+	nus_bench_hdr_init(&ping, NUS_BENCH_PING, run.ping_seq);
+
+	return bench_write(conn, &ping, sizeof(ping));
+}
+
+static int bench_sync(struct bt_conn *conn)
+{
+	int i;
+
+	run.state = BENCH_SYNC;
+	k_sem_reset(&bench_pong_sem);
+
+	for (i = 0; i < BENCH_SYNC_PINGS; i++) {
+		if (bench_ping(conn)) {
+			return -EIO;
+		}
+
+		k_sem_take(&bench_pong_sem, BENCH_PING_TIMEOUT);
+	}
+
+	return run.rtt.count ? 0 : -ETIMEDOUT;
+}
+
+static void bench_report(struct bt_conn *conn)
+{
+	struct bt_conn_info info;
+	u32_t span = run.last_us - run.first_us;
+	u32_t bps = 0;
+	u32_t rate = 0;
+
+	if (run.frames > 1 && span) {
+		bps = (u64_t)(run.bytes - run.frame_len) * USEC_PER_SEC / span;
+		rate = (u64_t)(run.frames - 1) * USEC_PER_SEC / span;
+	}
+
+	bt_conn_get_info(conn, &info);
+
+	printk("NUS_BENCH {\"mtu\":%u,\"payload\":%u,\"interval_us\":%u,"
+	       "\"bytes_per_s\":%u,\"notif_per_s\":%u,\"ttfb_us\":%u,",
+	       bt_gatt_get_mtu(conn), run.frame_len,
+	       info.le.interval * 1250, bps, rate,
+	       run.frames ? run.first_us - run.start_us : 0);
+	printk("\"owl_p50_us\":%u,\"owl_p90_us\":%u,\"owl_p99_us\":%u,",
+	       nus_bench_hist_pct(&run.owl, 50),
+	       nus_bench_hist_pct(&run.owl, 90),
+	       nus_bench_hist_pct(&run.owl, 99));
+	printk("\"rtt_p50_us\":%u,\"rtt_p90_us\":%u,\"rtt_p99_us\":%u,",
+	       nus_bench_hist_pct(&run.rtt, 50),
+	       nus_bench_hist_pct(&run.rtt, 90),
+	       nus_bench_hist_pct(&run.rtt, 99));
+	printk("\"frames\":%u,\"lost\":%u,\"complete\":%s}\n",
+	       run.frames,
+	       run.done_frames > run.frames ? run.done_frames - run.frames : 0,
+	       run.done ? "true" : "false");
+}
+
+static void bench_run(struct bt_conn *conn, u16_t payload_len)
+{
+	struct nus_bench_start start;
+	struct nus_bench_hdr stop;
+	u32_t deadline;
+
+	memset(&run, 0, sizeof(run));
+	run.best_rtt_us = UINT32_MAX;
+	k_sem_reset(&bench_done_sem);
+
+	if (bench_sync(conn)) {
+		printk("Benchmark: no answer from the peripheral\n");
+		return;
+	}
+
+	start.payload_len = sys_cpu_to_le16(payload_len);
+	start.reserved = 0;
+	start.duration_ms = sys_cpu_to_le32(CONFIG_NUS_BENCH_DURATION_MS);
+
+	run.state = BENCH_RUN;
+	nus_bench_hdr_init(&start.hdr, NUS_BENCH_START, 0);
+	run.start_us = sys_le32_to_cpu(start.hdr.time_us);
+
+	if (bench_write(conn, &start, sizeof(start))) {
+		printk("Benchmark: start failed\n");
+		return;
+	}
+
+	/* Keep probing the round trip while the stream is running */
+	deadline = k_uptime_get_32() + CONFIG_NUS_BENCH_DURATION_MS +
+		   BENCH_DONE_GRACE_MS;
+
+	while (k_sem_take(&bench_done_sem,
+			  K_MSEC(CONFIG_NUS_BENCH_PING_INTERVAL_MS)) &&
+	       !bench_lost) {
+		if ((s32_t)(deadline - k_uptime_get_32()) <= 0) {
+			nus_bench_hdr_init(&stop, NUS_BENCH_STOP, 0);
+			bench_write(conn, &stop, sizeof(stop));
+			break;
+		}
+
+		bench_ping(conn);
+	}
+
+	run.state = BENCH_IDLE;
+
+	if (!bench_lost) {
+		bench_report(conn);
+	}
+}
+
+static int bench_list(const char *str, u16_t *list)
+{
+	char *end;
+	int n = 0;
+
+	while (*str && n < BENCH_SWEEP_MAX) {
+		list[n] = strtoul(str, &end, 10);
+		if (end == str) {
+			break;
+		}
+
+		if (list[n]) {
+			n++;
+		}
+		str = end;
+	}
+
+	return n;
+}
+
+static void bench_interval_set(struct bt_conn *conn, u16_t interval)
+{
+	struct bt_le_conn_param param = {
+		.interval_min = interval,
+		.interval_max = interval,
+		.latency = 0,
+		.timeout = 400,
+	};
+	struct bt_conn_info info;
+
+	bt_conn_get_info(conn, &info);
+	if (info.le.interval == interval) {
+		return;
+	}
+
+	k_sem_reset(&bench_param_sem);
+
+	if (bt_conn_le_param_update(conn, &param) ||
+	    k_sem_take(&bench_param_sem, K_SECONDS(5))) {
+		printk("Benchmark: interval %u not applied\n", interval);
+	}
+}
+
+static void bench_thread(void *p1, void *p2, void *p3)
+{
+	u16_t payloads[BENCH_SWEEP_MAX];
+	u16_t intervals[BENCH_SWEEP_MAX];
+	int n_payloads, n_intervals;
+	int i, j;
+
+	n_payloads = bench_list(CONFIG_NUS_BENCH_PAYLOADS, payloads);
+	n_intervals = bench_list(CONFIG_NUS_BENCH_INTERVALS, intervals);
+
+	k_sem_take(&bench_start_sem, K_FOREVER);
+
+	for (i = 0; i < n_intervals && !bench_lost; i++) {
+		bench_interval_set(bench_conn, intervals[i]);
+
+		for (j = 0; j < n_payloads && !bench_lost; j++) {
+			bench_run(bench_conn, payloads[j]);
+		}
+	}
+
+	printk("NUS_BENCH_DONE\n");
+
+	/* Refuse later links, the sweep ran already */
+	bench_lost = 1;
+	bt_conn_unref(bench_conn);
+	bench_conn = NULL;
+}
+
+K_THREAD_DEFINE(bench_tid, 1536, bench_thread, NULL, NULL, NULL,
+		K_PRIO_PREEMPT(8), 0, K_NO_WAIT);
+
+static void bench_le_param_updated(struct bt_conn *conn, u16_t interval,
+				   u16_t latency, u16_t timeout)
+{
+	if (conn == bench_conn) {
+		k_sem_give(&bench_param_sem);
+	}
+}
+
+static void bench_disconnected(struct bt_conn *conn, u8_t reason)
+{
+	if (conn != bench_conn) {
+		return;
+	}
+
+	printk("Benchmark: peripheral lost\n");
+
+	/* Ends the sweep, the driver still owns the reference */
+	bench_lost = 1;
+	k_sem_give(&bench_done_sem);
+	k_sem_give(&bench_pong_sem);
+	k_sem_give(&bench_param_sem);
+}
+
+static struct bt_conn_cb bench_conn_callbacks = {
+	.disconnected = bench_disconnected,
+	.le_param_updated = bench_le_param_updated,
+};
+
+void bench_init(void)
+{
+	bt_conn_cb_register(&bench_conn_callbacks);
+}
+
+#endif /* CONFIG_NUS_BENCH */
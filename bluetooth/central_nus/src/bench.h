@@ -0,0 +1,30 @@
+/** @file
+ *  @brief Nordic NUS central benchmark driver
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <bluetooth/conn.h>
+
+/**@brief   Register the connection callbacks of the driver. */
+void bench_init(void);
+
+/**@brief   Start the sweep on a subscribed link, once per boot.
+ *
+ * @details Later links are ignored, they keep their usual behaviour.
+ */
+void bench_start(struct bt_conn *conn);
+
+/**@brief   Handle a notification received from NUS TX.
+ *
+ * @return  true if it was a benchmark frame and has been consumed.
+ */
+bool bench_notify(struct bt_conn *conn, const void *data, u16_t len);
+
+#endif /* __BENCH_H */
@@ -16,248 +16,447 @@
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
+#if defined(CONFIG_BT_SETTINGS)
+#include <settings/settings.h>
+#endif
 #include <bluetooth/conn.h>
 #include <bluetooth/uuid.h>
 #include <bluetooth/gatt.h>
-#include <misc/byteorder.h>
+#include <net/buf.h>
 #include <gatt/nus.h>
+#include <gatt/nus_cache.h>
+#include <gatt/nus_client.h>
+#include <gatt/nus_log.h>
+#if defined(CONFIG_NUS_FRAME)
+#include <misc/byteorder.h>
+#include <gatt/nus_frame.h>
+#endif
+
+#if defined(CONFIG_NUS_BENCH)
+#include "bench.h"
+#endif
+#include "scan.h"
 
 /* AUTH_NUMERIC_COMPARISON result in in LESC Numeric Comparison authentication
  * Undefine this result in LESC Passkey Input
  */
 #define AUTH_NUMERIC_COMPARISON
 
-/** Start security procedure from Peripheral to NUS Central on nRF5 or SmartPhone */
-/** BT_SECURITY_LOW(1)     No encryption and no authentication. */
-/** BT_SECURITY_MEDIUM(2)  Encryption and no authentication (no MITM). */
-/** BT_SECURITY_HIGH(3)    Encryption and authentication (MITM). */
-/** BT_SECURITY_FIPS(4)    Authenticated Secure Connections */
-#define BT_SECURITY     BT_SECURITY_FIPS
+/* Security NUS data needs, see CONFIG_NUS_SECURITY_LEVEL. The link is
+ * subscribed once it gets there; with level 1 right after connecting.
+ */
+#define BT_SECURITY     CONFIG_NUS_SECURITY_LEVEL
+
+/* Number of NUS peripherals served at the same time */
+#define NUS_LINKS		CONFIG_BT_MAX_CONN
 
-static struct bt_conn *default_conn;
+/* Notifications of all links are copied into this pool and queued to main() */
+#define NUS_RX_BUF_COUNT	16
+#define NUS_RX_BUF_SIZE		(CONFIG_BT_L2CAP_RX_MTU - 3)
 
-static struct bt_uuid_128 nus_uuid = BT_UUID_INIT_128(0);
-static struct bt_gatt_discover_params discover_params;
-static struct bt_gatt_subscribe_params subscribe_params;
+/* main() writes a demo pattern to every link this often */
+#define NUS_TX_PERIOD_MS	100
+/* Framed records grow up to this length, several writes long */
+#define NUS_FRAME_RECORD_MAX	500
+
+enum {
+	LINK_IDLE,
+	LINK_CONNECTING,
+	LINK_CONNECTED,
+	LINK_READY,
+};
+
+struct nus_link {
+	struct bt_conn *conn;
+	u8_t state;
+	u8_t first_rx;
+	u32_t connected_at;
+	u32_t ready_at;
+	u32_t rx_dropped;
+};
+
+static struct nus_link links[NUS_LINKS];
+/* Only one connection can be initiated at a time */
+static struct nus_link *connecting_link;
+
+/* Time to connect, from the last scan start */
+static u32_t scan_started_at;
+static u32_t scan_reports;
+
+#if defined(CONFIG_NUS_CHURN)
+/* Links torn down after streaming, and links lost before they got ready */
+static u32_t churn_cycles;
+static u32_t churn_lost;
+static u32_t churn_started_at;
+#endif
 
-static u8_t notify_func(struct bt_conn *conn,
-			   struct bt_gatt_subscribe_params *params,
-			   const void *data, u16_t length)
+NET_BUF_POOL_DEFINE(rx_pool, NUS_RX_BUF_COUNT, NUS_RX_BUF_SIZE, 1, NULL);
+static K_FIFO_DEFINE(rx_fifo);
+
+/* Data consumed from each link, only touched from main(). link_free()
+ * clears the slot from the BT RX thread, so the counters live here and
+ * start over whenever the link of a slot got ready at another time.
+ */
+struct link_rx {
+	u32_t ready_at;
+	u32_t bytes;
+	u32_t packets;
+};
+
+static struct link_rx link_rxs[NUS_LINKS];
+
+static struct link_rx *link_rx_get(u8_t idx)
 {
-	if (!data) {
-		printk("[UNSUBSCRIBED]\n");
-		params->value_handle = 0;
-		return BT_GATT_ITER_STOP;
-	}
+	struct link_rx *rx = &link_rxs[idx];
 
-	printk("[NOTIFICATION] data %c length %u\n", *(char *)data, length);
+	if (rx->ready_at != links[idx].ready_at) {
+		rx->ready_at = links[idx].ready_at;
+		rx->bytes = 0;
+		rx->packets = 0;
+	}
 
-	return BT_GATT_ITER_CONTINUE;
+	return rx;
 }
 
-static u8_t discover_func(struct bt_conn *conn,
-			     const struct bt_gatt_attr *attr,
-			     struct bt_gatt_discover_params *params)
+#if defined(CONFIG_NUS_FRAME)
+/* Framing state of each link, only touched from main(). A slot starts over
+ * whenever its link got ready at another time.
+ */
+struct link_frame {
+	u32_t ready_at;
+	/* Next record to send, kept until it went out whole */
+	u32_t record_index;
+	struct nus_frame_tx tx;
+	struct nus_frame_rx rx;
+};
+
+static struct link_frame link_frames[NUS_LINKS];
+#endif
+
+static void device_found(const bt_addr_le_t *addr, s8_t rssi, u8_t type,
+			 struct net_buf_simple *ad);
+
+static struct nus_link *link_get(struct bt_conn *conn)
 {
-	int err;
+	int i;
 
-	if (!attr) {
-		printk("Discover complete\n");
-		memset(params, 0, sizeof(*params));
-		return BT_GATT_ITER_STOP;
+	for (i = 0; i < ARRAY_SIZE(links); i++) {
+		if (links[i].state != LINK_IDLE && links[i].conn == conn) {
+			return &links[i];
+		}
 	}
 
-	printk("[ATTRIBUTE] handle %u\n", attr->handle);
+	return NULL;
+}
 
-	if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_NUS)) {
-  	    printk("BT_UUID_NUS found\n");
-        memcpy(&nus_uuid, BT_UUID_NUS_RX, sizeof(nus_uuid));
-		discover_params.uuid = &nus_uuid.uuid;
-		discover_params.start_handle = attr->handle + 1;
-		discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+static struct nus_link *link_alloc(void)
+{
+	int i;
 
-		err = bt_gatt_discover(conn, &discover_params);
-		if (err) {
-			printk("Discover failed (err %d)\n", err);
-		}
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_NUS_RX)) {
-  	    printk("BT_UUID_NUS_RX found\n");
-        memcpy(&nus_uuid, BT_UUID_NUS_TX, sizeof(nus_uuid));
-		discover_params.uuid = &nus_uuid.uuid;
-		discover_params.start_handle = attr->handle + 1;
-		discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
-
-		err = bt_gatt_discover(conn, &discover_params);
-		if (err) {
-			printk("Discover failed (err %d)\n", err);
-		}
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_NUS_TX)) {
-      	printk("BT_UUID_NUS_TX found\n");
-        struct bt_uuid_16 uuid = BT_UUID_INIT_16(0);
-		memcpy(&uuid, BT_UUID_GATT_CCC, sizeof(uuid));
-		discover_params.uuid = &uuid.uuid;
-		discover_params.start_handle = attr->handle + 2;
-		discover_params.type = BT_GATT_DISCOVER_DESCRIPTOR;
-		subscribe_params.value_handle = attr->handle + 1;
-
-		err = bt_gatt_discover(conn, &discover_params);
-		if (err) {
-			printk("Discover failed (err %d)\n", err);
-		}
-	} else {
-  	    printk("BT_UUID_GATT_CCC found\n");
-		subscribe_params.notify = notify_func;
-		subscribe_params.value = BT_GATT_CCC_NOTIFY;
-		subscribe_params.ccc_handle = attr->handle;
-
-		err = bt_gatt_subscribe(conn, &subscribe_params);
-		if (err && err != -EALREADY) {
-			printk("Subscribe failed (err %d)\n", err);
-		} else {
-			printk("[SUBSCRIBED]\n");
+	for (i = 0; i < ARRAY_SIZE(links); i++) {
+		if (links[i].state == LINK_IDLE) {
+			return &links[i];
 		}
+	}
+
+	return NULL;
+}
+
+/* Links are set up and torn down in the BT RX thread, other threads
+ * take a reference to the link first so that it cannot be freed under
+ * them.
+ */
+static void link_free(struct nus_link *link)
+{
+	struct bt_conn *conn;
+	unsigned int key;
 
-		return BT_GATT_ITER_STOP;
+	key = irq_lock();
+	conn = link->conn;
+	memset(link, 0, sizeof(*link));
+	irq_unlock(key);
+
+	if (conn) {
+		bt_conn_unref(conn);
+	}
+}
+
+/* Reference to the link of a slot if it is subscribed, NULL otherwise */
+static struct bt_conn *link_conn_get(struct nus_link *link)
+{
+	struct bt_conn *conn = NULL;
+	unsigned int key;
+
+	key = irq_lock();
+	if (link->state == LINK_READY) {
+		conn = bt_conn_ref(link->conn);
 	}
+	irq_unlock(key);
 
-	return BT_GATT_ITER_STOP;
+	return conn;
 }
 
-static void connected(struct bt_conn *conn, u8_t conn_err)
+/* NUS is listed in the advertising data, so scan requests would only
+ * double the reports to filter
+ */
+static int scan_start(void)
 {
-	char addr[BT_ADDR_LE_STR_LEN];
+	int err;
 
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+	if (connecting_link || !link_alloc()) {
+		return 0;
+	}
 
-	if (conn_err) {
-		printk("Failed to connect to %s (%u)\n", addr, conn_err);
+#if defined(CONFIG_NUS_CHURN)
+	if (churn_cycles >= CONFIG_NUS_CHURN_CYCLES) {
+		return 0;
+	}
+#endif
+
+	err = bt_le_scan_start(BT_LE_SCAN_PASSIVE, device_found);
+	if (err == -EALREADY) {
+		return 0;
+	}
+
+	if (err) {
+		printk("Scanning failed to start (err %d)\n", err);
+		return err;
+	}
+
+	scan_started_at = k_uptime_get_32();
+	scan_reports = 0;
+
+	return 0;
+}
+
+static void nus_data(struct bt_conn *conn, const void *data, u16_t length)
+{
+	struct nus_link *link = link_get(conn);
+	const u8_t *p = data;
+	struct net_buf *buf;
+	u16_t n;
+
+	if (!link) {
 		return;
 	}
 
-	printk("Connected: %s\n", addr);
+	if (!link->first_rx) {
+		link->first_rx = 1;
+		printk("Link %u first data %u ms after connect\n", link - links,
+		       k_uptime_get_32() - link->connected_at);
+	}
 
-#if 0
-	if (conn == default_conn) {
-    memcpy(&nus_uuid, BT_UUID_NUS, sizeof(nus_uuid));
-		discover_params.uuid = &nus_uuid.uuid;
-		discover_params.func = discover_func;
-		discover_params.start_handle = 0x0001;
-		discover_params.end_handle = 0xffff;
-		discover_params.type = BT_GATT_DISCOVER_PRIMARY;
+#if defined(CONFIG_NUS_BENCH)
+	if (bench_notify(conn, data, length)) {
+		return;
+	}
+#endif
 
-		int err = bt_gatt_discover(default_conn, &discover_params);
-		if (err) {
-			printk("Discover failed(err %d)\n", err);
+	/* Decompressed data comes in pieces of up to the compression window,
+	 * longer than a buffer, so spread it over as many as it needs. Never
+	 * block the BT RX thread, count what the consumer missed.
+	 */
+	while (length) {
+		buf = net_buf_alloc(&rx_pool, K_NO_WAIT);
+		if (!buf) {
+			link->rx_dropped++;
 			return;
 		}
+
+		n = min(length, net_buf_tailroom(buf));
+
+		*(u8_t *)net_buf_user_data(buf) = link - links;
+		net_buf_add_mem(buf, p, n);
+		net_buf_put(&rx_fifo, buf);
+
+		p += n;
+		length -= n;
 	}
-#endif
 }
 
-static bool eir_found(u8_t type, const u8_t *data, u8_t data_len,
-		      void *user_data)
+static void nus_ready(struct bt_conn *conn, bool cached)
 {
-	bt_addr_le_t *addr = user_data;
-
-  //printk("[AD]: %u data_len %u\n", type, data_len);
-
-	switch (type) {
-	case BT_DATA_UUID128_SOME:
-	case BT_DATA_UUID128_ALL:
-	  {
-  		if (data_len % 16 != 0) {
-  			printk("AD malformed\n");
-  			return true;
-  		}
-			struct bt_uuid* uuid;
-			u8_t val[16];
-			memcpy(val, data, 16);
-			uuid = BT_UUID_DECLARE_128(val[0], val[1], val[2], val[3], val[4],
-			                           val[5], val[6], val[7], val[8], val[9],
-			                           val[10], val[11], val[12], val[13], val[14], val[15]);
-			if (bt_uuid_cmp(uuid, BT_UUID_NUS)) {
-				return false;
-			}
-			int err = bt_le_scan_stop();
-			if (err) {
-				printk("Stop LE scan failed (err %d)\n", err);
-				return false;
-			}
-
-			default_conn = bt_conn_create_le(addr, BT_LE_CONN_PARAM_DEFAULT);
-			return false;
-		}
+	struct nus_link *link = link_get(conn);
+
+	if (!link) {
+		return;
 	}
 
-	return true;
+	link->ready_at = k_uptime_get_32();
+	link->state = LINK_READY;
+	printk("[SUBSCRIBED] link %u%s %u ms after connect\n", link - links,
+	       cached ? " (cached)" : "", link->ready_at - link->connected_at);
+
+#if defined(CONFIG_NUS_BENCH)
+	bench_start(conn);
+#endif
 }
 
-static void ad_parse(struct net_buf_simple *ad,
-		     bool (*func)(u8_t type, const u8_t *data,
-				  u8_t data_len, void *user_data),
-		     void *user_data)
+static void nus_payload_len(struct bt_conn *conn, u16_t payload_len)
 {
-	while (ad->len > 1) {
-		u8_t len = net_buf_simple_pull_u8(ad);
-		u8_t type;
+	printk("NUS payload size %u\n", payload_len);
+}
 
-		/* Check for early termination */
-		if (len == 0) {
-			return;
-		}
+static void nus_disconnected(struct bt_conn *conn)
+{
+	printk("[UNSUBSCRIBED]\n");
+}
 
-		if (len > ad->len) {
-			printk("AD malformed\n");
-			return;
-		}
+static const struct nus_client_cb nus_cb = {
+	.ready        = nus_ready,
+	.data         = nus_data,
+	.payload_len  = nus_payload_len,
+	.disconnected = nus_disconnected,
+};
 
-		type = net_buf_simple_pull_u8(ad);
+/* Subscribe to a link that reached the required security */
+static void link_start(struct nus_link *link)
+{
+	int err;
 
-		if (!func(type, ad->data, len - 1, user_data)) {
-			return;
+	err = nus_client_start(link->conn);
+	if (err && err != -EALREADY) {
+		printk("NUS lookup failed (err %d)\n", err);
+	}
+}
+
+static void connected(struct bt_conn *conn, u8_t conn_err)
+{
+	struct nus_link *link = link_get(conn);
+	char addr[BT_ADDR_LE_STR_LEN];
+	int err;
+
+	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+	if (link && link == connecting_link) {
+		connecting_link = NULL;
+	}
+
+	if (conn_err) {
+		printk("Failed to connect to %s (%u)\n", addr, conn_err);
+		if (link) {
+			link_free(link);
 		}
+		scan_start();
+		return;
+	}
 
-		net_buf_simple_pull(ad, len - 1);
+	printk("Connected: %s, %u ms and %u reports after scan start\n", addr,
+	       k_uptime_get_32() - scan_started_at, scan_reports);
+
+	if (!link) {
+		return;
 	}
+
+	link->state = LINK_CONNECTED;
+	link->connected_at = k_uptime_get_32();
+
+	if (BT_SECURITY > BT_SECURITY_LOW) {
+		/* Encrypts straight away with the LTK of a bonded peer */
+		err = bt_conn_security(conn, BT_SECURITY);
+		if (err) {
+			printk("Failed to set security (err %d)\n", err);
+		}
+	} else {
+		link_start(link);
+	}
+
+	/* Keep looking for more peripherals */
+	scan_start();
 }
 
 static void device_found(const bt_addr_le_t *addr, s8_t rssi, u8_t type,
 			 struct net_buf_simple *ad)
 {
+	struct nus_link *link;
+	struct bt_conn *conn;
+	int err;
+
+#if CONFIG_NUS_LOG_LEVEL_SCAN >= NUS_LOG_LEVEL_DBG
 	char dev[BT_ADDR_LE_STR_LEN];
 
 	bt_addr_le_to_str(addr, dev, sizeof(dev));
-	printk("[DEVICE]: %s, AD evt type %u, AD data len %u, RSSI %i\n",
-	       dev, type, ad->len, rssi);
+	NUS_LOG(SCAN, DBG, "%s, AD evt type %u, AD data len %u, RSSI %i",
+		dev, type, ad->len, rssi);
+#endif
+
+	scan_reports++;
+
+	/* Reports queued before scanning stopped */
+	if (connecting_link) {
+		return;
+	}
+
+	if (!scan_match(addr, rssi, type, ad->data, ad->len)) {
+		return;
+	}
 
-	/* We're only interested in connectable events */
-	if (type == BT_LE_ADV_IND || type == BT_LE_ADV_DIRECT_IND) {
-		/* TODO: Move this to a place it can be shared */
-		ad_parse(ad, eir_found, (void *)addr);
+	/* Already linked, our peripherals keep advertising */
+	conn = bt_conn_lookup_addr_le(addr);
+	if (conn) {
+		bt_conn_unref(conn);
+		return;
+	}
+
+	link = link_alloc();
+	if (!link) {
+		return;
 	}
+
+	err = bt_le_scan_stop();
+	if (err) {
+		printk("Stop LE scan failed (err %d)\n", err);
+		return;
+	}
+
+	link->conn = bt_conn_create_le(addr, BT_LE_CONN_PARAM_DEFAULT);
+	if (!link->conn) {
+		printk("Create connection failed\n");
+		scan_start();
+		return;
+	}
+
+	link->state = LINK_CONNECTING;
+	connecting_link = link;
 }
 
 static void disconnected(struct bt_conn *conn, u8_t reason)
 {
+	struct nus_link *link = link_get(conn);
 	char addr[BT_ADDR_LE_STR_LEN];
-	int err;
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
 	printk("Disconnected: %s (reason %u)\n", addr, reason);
 
-	if (default_conn != conn) {
+	if (!link) {
 		return;
 	}
 
-	bt_conn_unref(default_conn);
-	default_conn = NULL;
+	if (link == connecting_link) {
+		connecting_link = NULL;
+	}
 
-	/* This demo doesn't require active scan */
-	err = bt_le_scan_start(BT_LE_SCAN_PASSIVE, device_found);
-	if (err) {
-		printk("Scanning failed to start (err %d)\n", err);
+#if defined(CONFIG_NUS_CHURN)
+	if (link->state != LINK_READY) {
+		churn_lost++;
+	} else if (++churn_cycles % 100 == 0 ||
+		   churn_cycles == CONFIG_NUS_CHURN_CYCLES) {
+		printk("NUS_CHURN {\"cycles\":%u,\"lost\":%u,\"ms\":%u}\n",
+		       churn_cycles, churn_lost,
+		       k_uptime_get_32() - churn_started_at);
+
+		if (churn_cycles == CONFIG_NUS_CHURN_CYCLES) {
+			printk("NUS_CHURN_DONE\n");
+		}
 	}
+#endif
+
+	/* The slot is free again, the peer is picked up by scanning once it
+	 * advertises again.
+	 */
+	link_free(link);
+	scan_start();
 }
 
 #if defined(CONFIG_BT_SMP)
@@ -281,20 +480,12 @@ static void security_changed(struct bt_conn *conn, bt_security_t level)
 
 	printk("Security changed: %s level %u\n", addr, level);
 
-	if (level == BT_SECURITY_FIPS && conn == default_conn) {
-        memcpy(&nus_uuid, BT_UUID_NUS, sizeof(nus_uuid));
-		discover_params.uuid = &nus_uuid.uuid;
-		discover_params.func = discover_func;
-		discover_params.start_handle = 0x0001;
-		discover_params.end_handle = 0xffff;
-		discover_params.type = BT_GATT_DISCOVER_PRIMARY;
-
-		int err = bt_gatt_discover(default_conn, &discover_params);
-		if (err) {
-			printk("Discover failed(err %d)\n", err);
-			return;
-		}
+	struct nus_link *link = link_get(conn);
+	if (level < BT_SECURITY || !link || link->state != LINK_CONNECTED) {
+		return;
 	}
+
+	link_start(link);
 }
 #endif /* defined(CONFIG_BT_SMP) */
 
@@ -325,7 +516,7 @@ static void auth_pairing_confirm(struct bt_conn *conn)
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 	printk("Pairing Confirm for %s\n", addr);
-  if (conn == default_conn)
+  if (link_get(conn))
   {
     err = bt_conn_auth_pairing_confirm(conn);
   	if (err) {
@@ -354,7 +545,7 @@ static void auth_passkey_confirm(struct bt_conn *conn, unsigned int passkey)
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 	printk("Passkey Confirm for %s: %06u\n", addr, passkey);
-  if (conn == default_conn)
+  if (link_get(conn))
   {
     err = bt_conn_auth_passkey_confirm(conn);
   	if (err) {
@@ -387,7 +578,7 @@ static void auth_passkey_entry(struct bt_conn *conn)
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 	printk("Pairing entry for %s\n", addr);
-  if (conn == default_conn)
+  if (link_get(conn))
   {
     err = bt_conn_auth_passkey_entry(conn, 0x12345);
   	if (err) {
@@ -412,8 +603,183 @@ static struct bt_conn_auth_cb auth_cb_disaply_keyboard = {
 };
 #endif
 
+#if defined(CONFIG_NUS_FRAME)
+static struct link_frame *link_frame_get(u8_t idx)
+{
+	struct link_frame *frame = &link_frames[idx];
+
+	if (frame->ready_at != links[idx].ready_at) {
+		frame->ready_at = links[idx].ready_at;
+		frame->record_index = 0;
+		nus_frame_tx_init(&frame->tx);
+		nus_frame_rx_init(&frame->rx);
+	}
+
+	return frame;
+}
+
+/* A fragment only counts as sent if it went out whole. Its sequence
+ * number is not used up otherwise, so the peripheral sees a gap and drops
+ * the record instead of reassembling a truncated one.
+ */
+static s32_t frame_out(void *user_data, const u8_t *data, u16_t len)
+{
+	s32_t ret = nus_client_send(user_data, data, len);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* Out of credits or buffers partway */
+	return ret == len ? 0 : -EAGAIN;
+}
+
+static void frame_msg(void *user_data, struct net_buf *msg, u16_t len)
+{
+	/* Records start with their index, the rest may span fragments */
+	if (len >= sizeof(u32_t) && msg->len >= sizeof(u32_t)) {
+		NUS_LOG(DATA, DBG, "link %u record %u of %u bytes",
+			POINTER_TO_INT(user_data), sys_get_le32(msg->data), len);
+	}
+}
+
+/* Reassemble the records of a link. Fragments the consumer missed, as
+ * counted in rx_dropped, show up as gaps and drop their record.
+ */
+static void rx_frame(u8_t idx, struct net_buf *buf)
+{
+	struct nus_frame_rx *rx = &link_frame_get(idx)->rx;
+
+	/* The buffer is chained, not copied, until its record is complete */
+	if (nus_frame_rx_buf(rx, buf, frame_msg, INT_TO_POINTER(idx))) {
+		NUS_LOG_RATELIMIT(DATA, WRN, "link %u malformed fragment", idx);
+	}
+
+	NUS_LOG_RATELIMIT(DATA, INF,
+			  "link %u: %u records, %u gaps, %u dropped, %u CRC errors",
+			  idx, rx->messages, rx->gaps, rx->dropped,
+			  rx->crc_errors);
+}
+
+/* Build the record of an index. The records start with their index and
+ * grow up to NUS_FRAME_RECORD_MAX.
+ */
+static u16_t frame_record(u8_t *record, u32_t index)
+{
+	u16_t len = sizeof(u32_t) +
+		    index % (NUS_FRAME_RECORD_MAX - sizeof(u32_t));
+	int i;
+
+	sys_put_le32(index, record);
+	for (i = sizeof(u32_t); i < len; i++) {
+		record[i] = 'a' + (index + i) % 26;
+	}
+
+	return len;
+}
+
+/* Send the next record to every subscribed peripheral, in fragments of a
+ * write each. A record that did not go out whole is sent again next time.
+ */
+static void tx_frame_demo(void)
+{
+	static u8_t record[NUS_FRAME_RECORD_MAX];
+	struct link_frame *frame;
+	struct bt_conn *conn;
+	u16_t len;
+	s32_t err;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(links); i++) {
+		conn = link_conn_get(&links[i]);
+		if (!conn) {
+			continue;
+		}
+
+		frame = link_frame_get(i);
+		len = frame_record(record, frame->record_index);
+
+		/* A record cut short is dropped by the peripheral */
+		err = nus_frame_send(&frame->tx, record, len, true,
+				     nus_client_payload_len(conn),
+				     frame_out, conn);
+		bt_conn_unref(conn);
+
+		if (!err) {
+			frame->record_index++;
+		} else if (err != -EAGAIN && err != -ENOMEM &&
+			   err != -ENOTCONN) {
+			NUS_LOG_RATELIMIT(DATA, WRN,
+					  "link %u record failed (err %d)",
+					  i, err);
+		}
+	}
+}
+#endif
+
+/* Write a demo pattern to every subscribed peripheral */
+static void tx_demo(void)
+{
+#if defined(CONFIG_NUS_FRAME)
+	tx_frame_demo();
+#elif !defined(CONFIG_NUS_BENCH)
+	static u8_t tx_buf[NUS_RX_BUF_SIZE];
+	static u8_t tx_seq;
+	s32_t ret;
+	int i;
+
+	memset(tx_buf, 'a' + tx_seq++ % 26, sizeof(tx_buf));
+
+	for (i = 0; i < ARRAY_SIZE(links); i++) {
+		struct bt_conn *conn = link_conn_get(&links[i]);
+
+		if (!conn) {
+			continue;
+		}
+
+		/* Whatever does not fit now is skipped, it is only a demo */
+		ret = nus_client_send(conn, tx_buf, sizeof(tx_buf));
+		bt_conn_unref(conn);
+
+		if (ret < 0 && ret != -EAGAIN && ret != -ENOMEM &&
+		    ret != -ENOTCONN) {
+			NUS_LOG_RATELIMIT(DATA, WRN, "link %u write failed (err %d)",
+					  i, ret);
+		}
+	}
+#endif
+}
+
+#if defined(CONFIG_NUS_CHURN)
+/* Drop every link that has streamed for CONFIG_NUS_CHURN_HOLD_MS; the
+ * peripherals advertise again and get picked up by scanning.
+ */
+static void churn(void)
+{
+	struct bt_conn *conn;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(links); i++) {
+		conn = link_conn_get(&links[i]);
+		if (!conn) {
+			continue;
+		}
+
+		if (k_uptime_get_32() - links[i].ready_at >=
+		    CONFIG_NUS_CHURN_HOLD_MS) {
+			/* Fails harmlessly while already disconnecting */
+			bt_conn_disconnect(conn,
+					   BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		}
+
+		bt_conn_unref(conn);
+	}
+}
+#endif
+
 void main(void)
 {
+	u32_t tx_next = 0;
 	int err;
 	err = bt_enable(NULL);
 
@@ -424,18 +790,81 @@ void main(void)
 
 	printk("Bluetooth initialized\n");
 
+#if defined(CONFIG_NUS_CLIENT_HANDLE_CACHE)
+	err = nus_cache_init();
+	if (err) {
+		printk("NUS cache init failed (err %d)\n", err);
+	}
+#endif
+
+#if defined(CONFIG_BT_SETTINGS)
+	/* Restore bonds and cached handles */
+	settings_load();
+#endif
+
 	bt_conn_cb_register(&conn_callbacks);
+	nus_client_init(&nus_cb);
+#if defined(CONFIG_NUS_BENCH)
+	bench_init();
+#endif
 #if defined(AUTH_NUMERIC_COMPARISON)
 	bt_conn_auth_cb_register(&auth_cb_display_yesno);
 #else
 	bt_conn_auth_cb_register(&auth_cb_disaply_keyboard);
 #endif
-	err = bt_le_scan_start(BT_LE_SCAN_ACTIVE, device_found);
+#if defined(CONFIG_NUS_SCAN_BENCH)
+	scan_bench();
+#endif
+
+#if defined(CONFIG_NUS_CHURN)
+	churn_started_at = k_uptime_get_32();
+#endif
 
+	err = scan_start();
 	if (err) {
-		printk("Scanning failed to start (err %d)\n", err);
 		return;
 	}
 
 	printk("Scanning successfully started\n");
+
+	/* Consume the notifications of all links. Formatting every packet
+	 * would cost more than receiving it, so only a rate limited summary
+	 * is printed unless per packet logging is compiled in.
+	 */
+	while (1) {
+		struct net_buf *buf = net_buf_get(&rx_fifo,
+						  K_MSEC(NUS_TX_PERIOD_MS));
+		struct link_rx *rx;
+		u8_t idx;
+
+		if ((s32_t)(k_uptime_get_32() - tx_next) >= 0) {
+			tx_next = k_uptime_get_32() + NUS_TX_PERIOD_MS;
+			tx_demo();
+#if defined(CONFIG_NUS_CHURN)
+			churn();
+#endif
+		}
+
+		if (!buf) {
+			continue;
+		}
+
+		idx = *(u8_t *)net_buf_user_data(buf);
+		rx = link_rx_get(idx);
+
+		rx->bytes += buf->len;
+		rx->packets++;
+
+#if defined(CONFIG_NUS_FRAME)
+		rx_frame(idx, buf);
+#else
+		NUS_LOG(DATA, DBG, "link %u data %c length %u",
+			idx, buf->data[0], buf->len);
+		NUS_LOG_RATELIMIT(DATA, INF,
+				  "link %u: %u bytes in %u notifications, %u dropped",
+				  idx, rx->bytes, rx->packets,
+				  links[idx].rx_dropped);
+		net_buf_unref(buf);
+#endif
+	}
 }
@@ -0,0 +1,188 @@
+/** @file
+ *  @brief Nordic NUS central advertising report filter
+ *
+ *  In a busy environment the central sees far more advertising reports
+ *  than it connects to, so the filter rejects on the cheapest property
+ *  first and walks the AD structures in place, comparing every 128-bit
+ *  UUID of a list against the NUS UUID.
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <misc/printk.h>
+#include <zephyr.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/uuid.h>
+
+#include <gatt/nus.h>
+
+#include "scan.h"
+
+#define NUS_UUID_LEN		16
+
+/* BT_UUID_NUS in advertising byte order */
+static const u8_t nus_uuid[NUS_UUID_LEN] = {
+	0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0,
+	0x93, 0xF3, 0xA3, 0xB5, 0x01, 0x00, 0x40, 0x6E,
+};
+
+static bool ad_has_nus(const u8_t *data, u8_t len)
+{
+	u8_t field_len, i;
+
+	while (len > 1) {
+		field_len = data[0];
+
+		/* Early termination or malformed */
+		if (!field_len || field_len >= len) {
+			return false;
+		}
+
+		if (data[1] == BT_DATA_UUID128_ALL ||
+		    data[1] == BT_DATA_UUID128_SOME) {
+			for (i = 2; i + NUS_UUID_LEN <= field_len + 1;
+			     i += NUS_UUID_LEN) {
+				if (!memcmp(&data[i], nus_uuid, NUS_UUID_LEN)) {
+					return true;
+				}
+			}
+		}
+
+		data += field_len + 1;
+		len -= field_len + 1;
+	}
+
+	return false;
+}
+
+bool scan_match(const bt_addr_le_t *addr, s8_t rssi, u8_t type,
+		const u8_t *data, u8_t len)
+{
+	/* We're only interested in connectable events */
+	if (type != BT_LE_ADV_IND && type != BT_LE_ADV_DIRECT_IND) {
+		return false;
+	}
+
+#if defined(CONFIG_BT_SMP)
+	/* Peers we bonded with are NUS peripherals, reports of a resolved
+	 * private address carry the identity already
+	 */
+	if (bt_addr_le_is_bonded(addr)) {
+		return true;
+	}
+#endif
+
+	if (rssi < CONFIG_NUS_SCAN_RSSI_MIN) {
+		return false;
+	}
+
+	return ad_has_nus(data, len);
+}
+
+#if defined(CONFIG_NUS_SCAN_BENCH)
+#define BENCH_AD_MAX		31
+
+struct bench_report {
+	bt_addr_le_t addr;
+	s8_t rssi;
+	u8_t type;
+	u8_t len;
+	u8_t data[BENCH_AD_MAX];
+};
+
+static struct bench_report bench_reports[CONFIG_NUS_SCAN_BENCH_ADVERTISERS];
+
+static u32_t bench_rand(u32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+
+	return *seed >> 8;
+}
+
+/* Flags followed by a 128-bit UUID list, a 16-bit UUID list or a name,
+ * with the NUS UUID second in the list of every 100th advertiser.
+ */
+static void bench_report_init(struct bench_report *r, u32_t idx, u32_t *seed)
+{
+	u8_t *p = r->data;
+	u32_t kind = bench_rand(seed) % 3;
+	int i;
+
+	r->addr.type = BT_ADDR_LE_RANDOM;
+	for (i = 0; i < sizeof(r->addr.a.val); i++) {
+		r->addr.a.val[i] = bench_rand(seed);
+	}
+
+	r->rssi = -30 - bench_rand(seed) % 70;
+	r->type = bench_rand(seed) % 4 ? BT_LE_ADV_IND : BT_LE_ADV_NONCONN_IND;
+
+	*p++ = 2;
+	*p++ = BT_DATA_FLAGS;
+	*p++ = BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR;
+
+	if (!(idx % 100) || kind == 0) {
+		*p++ = 1 + 2 * NUS_UUID_LEN;
+		*p++ = BT_DATA_UUID128_SOME;
+		for (i = 0; i < 2 * NUS_UUID_LEN; i++) {
+			*p++ = bench_rand(seed);
+		}
+
+		if (!(idx % 100)) {
+			memcpy(p - NUS_UUID_LEN, nus_uuid, NUS_UUID_LEN);
+		}
+	} else if (kind == 1) {
+		*p++ = 7;
+		*p++ = BT_DATA_UUID16_ALL;
+		for (i = 0; i < 6; i++) {
+			*p++ = bench_rand(seed);
+		}
+	} else {
+		*p++ = 9;
+		*p++ = BT_DATA_NAME_COMPLETE;
+		memcpy(p, "beacon00", 8);
+		p += 8;
+	}
+
+	r->len = p - r->data;
+}
+
+void scan_bench(void)
+{
+	u32_t seed = 1;
+	u32_t matches = 0;
+	u32_t start, cycles;
+	u64_t ns;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bench_reports); i++) {
+		bench_report_init(&bench_reports[i], i, &seed);
+	}
+
+	start = k_cycle_get_32();
+
+	for (i = 0; i < ARRAY_SIZE(bench_reports); i++) {
+		struct bench_report *r = &bench_reports[i];
+
+		if (scan_match(&r->addr, r->rssi, r->type, r->data, r->len)) {
+			matches++;
+		}
+	}
+
+	cycles = k_cycle_get_32() - start;
+	ns = (u64_t)cycles * NSEC_PER_SEC / sys_clock_hw_cycles_per_sec;
+
+	printk("NUS_SCAN_BENCH {\"reports\":%u,\"matches\":%u,"
+	       "\"total_us\":%u,\"ns_per_report\":%u}\n",
+	       (u32_t)ARRAY_SIZE(bench_reports), matches, (u32_t)(ns / 1000),
+	       (u32_t)(ns / ARRAY_SIZE(bench_reports)));
+}
+#endif /* CONFIG_NUS_SCAN_BENCH */
@@ -0,0 +1,33 @@
+/** @file
+ *  @brief Nordic NUS central advertising report filter
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __SCAN_H
+#define __SCAN_H
+
+#include <bluetooth/bluetooth.h>
+
+/**@brief   Decide whether an advertiser is a NUS peripheral to connect to.
+ *
+ * @details Runs for every advertising report, so it neither copies nor
+ *          formats anything: bonded peers are accepted on their address
+ *          alone, others must be connectable, at least
+ *          CONFIG_NUS_SCAN_RSSI_MIN strong and list the NUS UUID in their
+ *          advertising data.
+ */
+bool scan_match(const bt_addr_le_t *addr, s8_t rssi, u8_t type,
+		const u8_t *data, u8_t len);
+
+#if defined(CONFIG_NUS_SCAN_BENCH)
+/**@brief   Time @ref scan_match on synthetic advertisers and print the
+ *          result.
+ */
+void scan_bench(void);
+#endif
+
+#endif /* __SCAN_H */
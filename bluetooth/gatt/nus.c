@@ -21,90 +21,2350 @@
 #include <bluetooth/conn.h>
 #include <bluetooth/gatt.h>
 #include <bluetooth/uuid.h>
+#include <atomic.h>
+
+#if defined(CONFIG_NUS_STATS_SHELL)
+#include <shell/shell.h>
+#endif
 
 #include "nus.h"
+#include "nus_log.h"
+#if defined(CONFIG_NUS_COMPRESS)
+#include "nus_comp.h"
+#endif
+
+#define NUS_INSTANCES		CONFIG_NUS_INSTANCES
+
+/* Attributes of one NUS instance. The table is laid out at compile time,
+ * so the data path addresses TX by a constant index instead of a lookup.
+ */
+enum {
+	NUS_ATTR_SVC,
+	NUS_ATTR_RX_CHRC,
+	NUS_ATTR_RX,
+	NUS_ATTR_TX_CHRC,
+	NUS_ATTR_TX,
+	NUS_ATTR_TX_CCC,
+	NUS_ATTR_COUNT,
+};
+
+static struct bt_gatt_attr nus_attrs[NUS_INSTANCES][NUS_ATTR_COUNT];
+static struct bt_gatt_ccc_cfg nus_ccc_cfg[NUS_INSTANCES][BT_GATT_CCC_MAX];
+
+/* TX value of an instance, and the instance an attribute belongs to */
+#define NUS_TX_ATTR(chan)	(&nus_attrs[chan][NUS_ATTR_TX])
+#define NUS_ATTR_CHAN(attr)	(((attr) - nus_attrs[0]) / NUS_ATTR_COUNT)
+
+#if defined(CONFIG_NUS_TX_INDICATE)
+#define NUS_CCC_MASK		(BT_GATT_CCC_NOTIFY | BT_GATT_CCC_INDICATE)
+#else
+#define NUS_CCC_MASK		BT_GATT_CCC_NOTIFY
+#endif
 
-static struct bt_gatt_ccc_cfg nus_ccc_cfg[BT_GATT_CCC_MAX] = {};
-static u8_t nus_rx;
-static u8_t nus_tx_started;
 static ble_nus_init_t ble_nus = {
-  .data_handler = NULL
+  .data_handler = NULL,
+  .payload_len_handler = NULL,
+  .link_profile = NUS_LINK_PROFILE_NONE,
+  .link_handler = NULL,
+  .ready_handler = NULL
+};
+
+#if defined(CONFIG_BT_GATT_CLIENT)
+enum {
+	NUS_MTU_IDLE,
+	NUS_MTU_PENDING,
+	NUS_MTU_DONE,
+};
+#endif
+
+#if defined(CONFIG_NUS_TX_QUEUE)
+BUILD_ASSERT_MSG((CONFIG_NUS_TX_RING_SIZE & (CONFIG_NUS_TX_RING_SIZE - 1)) == 0,
+		 "CONFIG_NUS_TX_RING_SIZE must be a power of two");
+
+enum {
+	NUS_BATCH_IDLE,
+	/* Being filled in by nus_send_batch() */
+	NUS_BATCH_CLAIMED,
+	/* Owned by the drain thread */
+	NUS_BATCH_QUEUED,
+};
+#endif
+
+#if defined(CONFIG_NUS_COMPRESS)
+/* Framing of TX data on instance 0. It only changes in the drain thread,
+ * right after it answered a capability frame of the peer.
+ */
+enum {
+	/* Plain notifications */
+	NUS_COMP_OFF,
+	/* Capability frame received, answer pending */
+	NUS_COMP_SWITCHING,
+	/* Every data notification starts with a NUS_COMP_HDR_* byte */
+	NUS_COMP_ON,
+};
+#endif
+
+#if defined(CONFIG_NUS_TX_INDICATE)
+/* An indication is only confirmed once it reached the peer application,
+ * so the next PDU of the TX queue waits in a staging buffer and goes out
+ * straight from the confirmation.
+ */
+enum {
+	NUS_IND_IDLE,
+	/* One indication in flight */
+	NUS_IND_BUSY,
+	/* One in flight and the next one staged */
+	NUS_IND_STAGED,
+	/* Staged, but the confirmation could not send it */
+	NUS_IND_HELD,
+};
+#endif
+
+#if defined(CONFIG_NUS_BUF_POOL)
+BUILD_ASSERT_MSG((CONFIG_NUS_TX_BUF_QUEUE_LEN &
+		  (CONFIG_NUS_TX_BUF_QUEUE_LEN - 1)) == 0,
+		 "CONFIG_NUS_TX_BUF_QUEUE_LEN must be a power of two");
+
+#if defined(CONFIG_NUS_CREDITS) && !defined(CONFIG_NUS_RX_ZERO_COPY)
+/* RX writes live in pool buffers, their credits come back on release */
+#define NUS_CREDIT_ON_RELEASE
+
+/* Write held by a pool buffer. gen tells the links of a slot apart. */
+struct nus_rx_owner {
+	u8_t ctx;
+	u8_t gen;
+};
+
+static void nus_buf_destroy(struct net_buf *buf);
+
+NET_BUF_POOL_DEFINE(nus_buf_pool, CONFIG_NUS_BUF_COUNT, CONFIG_NUS_BUF_SIZE,
+		    sizeof(struct nus_rx_owner), nus_buf_destroy);
+#else
+NET_BUF_POOL_DEFINE(nus_buf_pool, CONFIG_NUS_BUF_COUNT, CONFIG_NUS_BUF_SIZE,
+		    0, NULL);
+#endif
+#endif
+
+#if defined(CONFIG_NUS_STATS)
+/* Counters are bumped from the BT RX thread, the TX drain thread and the
+ * application alike, hence atomic. Each histogram and the high-water mark
+ * has a single writer and is updated with plain stores.
+ */
+struct nus_ctx_stats {
+	atomic_t tx_bytes;
+	atomic_t tx_packets;
+	atomic_t tx_errors;
+	atomic_t tx_err_nomem;
+	atomic_t tx_err_notconn;
+	atomic_t rx_bytes;
+	atomic_t rx_packets;
+	atomic_t rx_rejected;
+	atomic_t ccc_enabled;
+	atomic_t ccc_disabled;
+	u32_t tx_queue_hwm;
+	u32_t comp_in_bytes;
+	u32_t comp_out_bytes;
+	u32_t comp_cycles;
+	u32_t enqueue_to_air[NUS_STATS_HIST_BUCKETS];
+	u32_t write_to_handler[NUS_STATS_HIST_BUCKETS];
+	/* Ring position and cycle time of the enqueue being timed */
+	u32_t tx_mark;
+	u32_t tx_mark_cycles;
+	atomic_t tx_mark_set;
+};
+
+#define NUS_STAT_INC(ctx, f)	atomic_inc(&(ctx)->stats.f)
+#define NUS_STAT_ADD(ctx, f, n)	atomic_add(&(ctx)->stats.f, (n))
+#else
+#define NUS_STAT_INC(ctx, f)
+#define NUS_STAT_ADD(ctx, f, n)
+#endif
+
+/* Slot flags, see nus_ctx_hold() */
+enum {
+	/* Owned by a link, from nus_connected() until its last reference
+	 * is gone and, with the TX queue, what it queued is released
+	 */
+	NUS_CTX_BUSY,
+	/* Link up, further references may be taken */
+	NUS_CTX_UP,
+	/* Subscribed and secured, see nus_ctx_update() */
+	NUS_CTX_READY,
+	/* Link released, the drain thread frees the slot once it has
+	 * flushed its TX queue
+	 */
+	NUS_CTX_FLUSH,
+};
+
+/* Per connection NUS state. A slot is claimed in nus_connected() and
+ * reference counted from then on: the link holds one reference until it
+ * disconnects, and everything outside the BT RX thread holds one while it
+ * uses the slot, see nus_ctx_hold(). The last reference releases the link,
+ * so a slot is never reset under a sender, and a sender never reaches the
+ * next link of its slot by accident.
+ */
+struct nus_conn_ctx {
+	/* Set while the slot is referenced */
+	struct bt_conn *conn;
+	atomic_t flags;
+	atomic_t refs;
+	u32_t connected_at;
+	u32_t ready_ms;
+	/* Time to the first notification, timed from ready_at */
+	u32_t ready_at;
+	u32_t first_tx_ms;
+	nus_link_profile_t link_profile;
+#if defined(CONFIG_NUS_TX_INDICATE)
+	/* Indication in flight and the PDU staged behind it, see the
+	 * NUS_IND states
+	 */
+	struct bt_gatt_indicate_params ind_params;
+	atomic_t ind_state;
+#if defined(CONFIG_NUS_TX_QUEUE)
+	u8_t ind_stage[CONFIG_BT_L2CAP_TX_MTU - 3];
+	u16_t ind_stage_len;
+#endif
+#endif
+#if defined(CONFIG_NUS_STATS)
+	struct nus_ctx_stats stats;
+#endif
+#if !defined(CONFIG_NUS_RX_ZERO_COPY)
+#if defined(CONFIG_NUS_BUF_POOL)
+	/* Last write, kept for reading the attribute back with
+	 * CONFIG_NUS_RX_READ
+	 */
+	struct net_buf *rx_buf;
+#else
+	u8_t rx[NUS_RX_MAX_LEN];
+	u16_t rx_len;
+#endif
+#endif
+#if defined(CONFIG_BT_GATT_CLIENT)
+	struct bt_gatt_exchange_params mtu_params;
+	u8_t mtu_state;
+#endif
+#if defined(CONFIG_NUS_TX_QUEUE)
+	/* Single producer / single consumer byte ring. The indexes run
+	 * freely and are masked on access; head is only written by the
+	 * producer and tail only by the drain thread, so neither side needs
+	 * a lock. Bytes before tx_drop belong to a previous connection of
+	 * this slot and are skipped by the drain thread.
+	 */
+	u8_t tx_ring[CONFIG_NUS_TX_RING_SIZE];
+	atomic_t tx_head;
+	atomic_t tx_tail;
+	atomic_t tx_drop;
+#if defined(CONFIG_NUS_BUF_POOL)
+	/* Pool buffers queued by reference, indexed like the byte ring.
+	 * Every entry holds a reference that the drain thread releases;
+	 * tx_buf_off is how much of the oldest one has been sent.
+	 */
+	struct net_buf *tx_bufs[CONFIG_NUS_TX_BUF_QUEUE_LEN];
+	/* Entries queued with nus_tx_enqueue_pdu(), never split */
+	bool tx_buf_pdu[CONFIG_NUS_TX_BUF_QUEUE_LEN];
+	atomic_t tx_buf_head;
+	atomic_t tx_buf_tail;
+	atomic_t tx_buf_drop;
+	u16_t tx_buf_off;
+#endif
+	/* Pending nus_send_batch(), see the NUS_BATCH states */
+	atomic_t batch_state;
+	struct bt_conn *batch_conn;
+	const struct nus_iovec *batch_vec;
+	size_t batch_cnt;
+	size_t batch_idx;
+	u16_t batch_off;
+	nus_batch_cb_t batch_cb;
+	void *batch_user_data;
+#if defined(CONFIG_NUS_CREDITS)
+	/* Consumed writes not returned to the peer yet */
+	atomic_t credits_pending;
+	u8_t credits_granted;
+	u8_t credit_gen;
+#endif
+#if defined(CONFIG_NUS_COMPRESS)
+	/* See the NUS_COMP states. tx_direct counts nus_send() calls in
+	 * flight on instance 0, the framing only switches without any.
+	 */
+	atomic_t comp_state;
+	atomic_t tx_direct;
+	u8_t comp_caps;
+	struct nus_comp_enc comp_enc;
+	/* Block taken from the ring, kept until it is sent */
+	u8_t comp_pdu[CONFIG_BT_L2CAP_TX_MTU - 3];
+	u16_t comp_len;
+#endif
+#endif
 };
 
+static struct nus_conn_ctx nus_ctx[CONFIG_BT_MAX_CONN];
+
+/* Security a link needs before NUS data flows in either direction */
+static bt_security_t nus_sec_level = CONFIG_NUS_SECURITY_LEVEL;
+
+#if defined(CONFIG_NUS_TX_QUEUE)
+static K_SEM_DEFINE(nus_tx_sem, 0, 1);
+#endif
+
+/* Slot of a link, for the callbacks of the BT RX thread only: links come
+ * and go in that thread, so the slot cannot change under them.
+ */
+static struct nus_conn_ctx *nus_ctx_get(struct bt_conn *conn)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(nus_ctx); i++) {
+		if (conn && nus_ctx[i].conn == conn &&
+		    atomic_test_bit(&nus_ctx[i].flags, NUS_CTX_UP)) {
+			return &nus_ctx[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* The last reference of a slot is gone, hand the link back */
+static void nus_ctx_release(struct nus_conn_ctx *ctx)
+{
+	struct bt_conn *conn = ctx->conn;
+
+	ctx->conn = NULL;
+
+#if !defined(CONFIG_NUS_RX_ZERO_COPY) && defined(CONFIG_NUS_BUF_POOL)
+	if (ctx->rx_buf) {
+		net_buf_unref(ctx->rx_buf);
+		ctx->rx_buf = NULL;
+	}
+#endif
+
+	bt_conn_unref(conn);
+
+#if defined(CONFIG_NUS_TX_QUEUE)
+	/* Buffers and a batch may still be queued, and releasing them may
+	 * call back into the application: leave that to the drain thread,
+	 * which frees the slot for the next link afterwards
+	 */
+	atomic_set_bit(&ctx->flags, NUS_CTX_FLUSH);
+	k_sem_give(&nus_tx_sem);
+#else
+	/* Free for the next link */
+	atomic_clear_bit(&ctx->flags, NUS_CTX_BUSY);
+#endif
+}
+
+static void nus_ctx_put(struct nus_conn_ctx *ctx)
+{
+	if (atomic_dec(&ctx->refs) == 1) {
+		nus_ctx_release(ctx);
+	}
+}
+
+/* Take a reference to a slot whose link is up, without locking; safe
+ * from any context including ISRs. The slot may have been handed to
+ * another link since it was looked at, callers check ctx->conn once they
+ * hold it.
+ */
+static bool nus_ctx_hold(struct nus_conn_ctx *ctx)
+{
+	atomic_val_t refs;
+
+	do {
+		refs = atomic_get(&ctx->refs);
+		if (!refs) {
+			return false;
+		}
+	} while (!atomic_cas(&ctx->refs, refs, refs + 1));
+
+	/* Caught the link on its way down */
+	if (!atomic_test_bit(&ctx->flags, NUS_CTX_UP)) {
+		nus_ctx_put(ctx);
+		return false;
+	}
+
+	return true;
+}
+
+/* Hold the slot of a link, for callers outside the BT RX thread */
+static struct nus_conn_ctx *nus_ctx_hold_conn(struct bt_conn *conn)
+{
+	struct nus_conn_ctx *ctx;
+
+	for (ctx = nus_ctx; ctx < &nus_ctx[ARRAY_SIZE(nus_ctx)]; ctx++) {
+		if (!conn || ctx->conn != conn || !nus_ctx_hold(ctx)) {
+			continue;
+		}
+
+		if (ctx->conn == conn) {
+			return ctx;
+		}
+
+		nus_ctx_put(ctx);
+	}
+
+	return NULL;
+}
+
+/* The CCC table already keeps the subscription of each peer; the
+ * cfg_changed callback only reports the aggregate of all of them.
+ */
+static u16_t nus_ctx_ccc(struct nus_conn_ctx *ctx, u8_t chan)
+{
+	struct bt_conn *conn = ctx->conn;
+	const bt_addr_le_t *dst;
+	int i;
+
+	if (!conn) {
+		return 0;
+	}
+
+	dst = bt_conn_get_dst(conn);
+
+	for (i = 0; i < BT_GATT_CCC_MAX; i++) {
+		if (!bt_addr_le_cmp(&nus_ccc_cfg[chan][i].peer, dst)) {
+			return nus_ccc_cfg[chan][i].value & NUS_CCC_MASK;
+		}
+	}
+
+	return 0;
+}
+
+static bool nus_conn_secured(struct bt_conn *conn)
+{
+#if defined(CONFIG_BT_SMP)
+	return bt_conn_get_security(conn) >= nus_sec_level;
+#else
+	return nus_sec_level <= BT_SECURITY_LOW;
+#endif
+}
+
+/* Subscribed to an instance and secure enough to receive data */
+static bool nus_ctx_chan_ready(struct nus_conn_ctx *ctx, u8_t chan)
+{
+	struct bt_conn *conn = ctx->conn;
+
+	return conn && nus_conn_secured(conn) && nus_ctx_ccc(ctx, chan);
+}
+
+/* The link itself is ready with the first instance */
+static bool nus_ctx_ready(struct nus_conn_ctx *ctx)
+{
+	return nus_ctx_chan_ready(ctx, 0);
+}
+
+#if defined(CONFIG_NUS_TX_INDICATE)
+/* Peers that enabled indications but not notifications get indications */
+static bool nus_ctx_indicating(struct nus_conn_ctx *ctx, u8_t chan)
+{
+	return !(nus_ctx_ccc(ctx, chan) & BT_GATT_CCC_NOTIFY);
+}
+
+static void nus_indicate_rsp(struct bt_conn *conn,
+			     const struct bt_gatt_attr *attr, u8_t err);
+
+/* The caller owns ind_params, i.e. moved ind_state to NUS_IND_BUSY */
+static int nus_ind_send(struct nus_conn_ctx *ctx, struct bt_conn *conn,
+			u8_t chan, const void *data, u16_t len)
+{
+	/* The data is copied into the PDU right away */
+	ctx->ind_params.attr = NUS_TX_ATTR(chan);
+	ctx->ind_params.func = nus_indicate_rsp;
+	ctx->ind_params.data = data;
+	ctx->ind_params.len = len;
+
+	return bt_gatt_indicate(conn, &ctx->ind_params);
+}
+
+static void nus_indicate_rsp(struct bt_conn *conn,
+			     const struct bt_gatt_attr *attr, u8_t err)
+{
+	struct nus_conn_ctx *ctx = nus_ctx_get(conn);
+
+	if (!ctx) {
+		return;
+	}
+
+#if defined(CONFIG_NUS_TX_QUEUE)
+	if (atomic_cas(&ctx->ind_state, NUS_IND_STAGED, NUS_IND_BUSY)) {
+		if (nus_ind_send(ctx, conn, 0, ctx->ind_stage,
+				 ctx->ind_stage_len)) {
+			/* Out of buffers here, the drain thread retries */
+			atomic_set(&ctx->ind_state, NUS_IND_HELD);
+		}
+	} else {
+		atomic_set(&ctx->ind_state, NUS_IND_IDLE);
+	}
+
+	/* Room to stage the next one */
+	k_sem_give(&nus_tx_sem);
+#else
+	atomic_set(&ctx->ind_state, NUS_IND_IDLE);
+#endif
+}
+#endif
+
+/* Send one PDU on TX of an instance right away. An indication fails with
+ * -EBUSY while the previous one is not confirmed yet.
+ */
+static int nus_ctx_tx(struct nus_conn_ctx *ctx, struct bt_conn *conn,
+		      u8_t chan, const void *data, u16_t len)
+{
+	int err;
+
+#if defined(CONFIG_NUS_TX_INDICATE)
+	if (nus_ctx_indicating(ctx, chan)) {
+		if (!atomic_cas(&ctx->ind_state, NUS_IND_IDLE, NUS_IND_BUSY)) {
+			return -EBUSY;
+		}
+
+		err = nus_ind_send(ctx, conn, chan, data, len);
+		if (err) {
+			atomic_set(&ctx->ind_state, NUS_IND_IDLE);
+			return err;
+		}
+	} else
+#endif
+	{
+		err = bt_gatt_notify(conn, NUS_TX_ATTR(chan), data, len);
+		if (err) {
+			return err;
+		}
+	}
+
+	if (ctx->first_tx_ms == UINT32_MAX) {
+		ctx->first_tx_ms = k_uptime_get_32() - ctx->ready_at;
+		NUS_LOG(DATA, INF, "first notification %u ms after ready",
+			ctx->first_tx_ms);
+	}
+
+	return 0;
+}
+
+#if defined(CONFIG_NUS_CREDITS)
+/* Hand credits back, in batches of CONFIG_NUS_CREDITS_THRESHOLD. Safe
+ * from any context.
+ */
+static void nus_credit_return(struct nus_conn_ctx *ctx, u16_t n)
+{
+	if (atomic_add(&ctx->credits_pending, n) + n >=
+	    CONFIG_NUS_CREDITS_THRESHOLD) {
+		k_sem_give(&nus_tx_sem);
+	}
+}
+#endif
+
+#if defined(NUS_CREDIT_ON_RELEASE)
+static void nus_buf_destroy(struct net_buf *buf)
+{
+	struct nus_rx_owner *owner = net_buf_user_data(buf);
+
+	if (owner->ctx < ARRAY_SIZE(nus_ctx) &&
+	    nus_ctx[owner->ctx].credit_gen == owner->gen) {
+		nus_credit_return(&nus_ctx[owner->ctx], 1);
+	}
+
+	net_buf_destroy(buf);
+}
+#endif
+
+/* Track the link becoming ready, called whenever its subscription or
+ * security may have changed.
+ */
+static void nus_ctx_update(struct nus_conn_ctx *ctx)
+{
+	if (!nus_ctx_ready(ctx)) {
+		atomic_clear_bit(&ctx->flags, NUS_CTX_READY);
+		return;
+	}
+
+	if (atomic_test_and_set_bit(&ctx->flags, NUS_CTX_READY)) {
+		return;
+	}
+
+	ctx->ready_at = k_uptime_get_32();
+	ctx->ready_ms = ctx->ready_at - ctx->connected_at;
+	ctx->first_tx_ms = UINT32_MAX;
+
+	if (ble_nus.ready_handler != NULL) {
+		ble_nus.ready_handler(ctx->conn, ctx->ready_ms);
+	}
+
+#if defined(CONFIG_NUS_CREDITS)
+	/* The first grant opens the RX window of the link */
+	if (!ctx->credits_granted) {
+		ctx->credits_granted = 1;
+		nus_credit_return(ctx, CONFIG_NUS_CREDITS_INITIAL);
+	}
+#endif
+
+#if defined(CONFIG_NUS_TX_QUEUE)
+	/* Flush whatever was queued while the link was not ready */
+	k_sem_give(&nus_tx_sem);
+#endif
+}
+
+#if defined(CONFIG_NUS_STATS)
+/* Bucket i holds [2^(i-1), 2^i) cycles, a single bit scan */
+static inline void nus_hist_add(u32_t *hist, u32_t cycles)
+{
+	hist[min(find_msb_set(cycles), NUS_STATS_HIST_BUCKETS - 1)]++;
+}
+#endif
+
+static void nus_stat_tx_error(struct nus_conn_ctx *ctx, int err)
+{
+	/* Waiting for an indication to be confirmed is flow control */
+	if (err == -EBUSY) {
+		return;
+	}
+
+	NUS_STAT_INC(ctx, tx_errors);
+
+	if (err == -ENOMEM) {
+		NUS_STAT_INC(ctx, tx_err_nomem);
+	} else if (err == -ENOTCONN) {
+		NUS_STAT_INC(ctx, tx_err_notconn);
+	}
+}
+
 static void nus_ccc_cfg_changed(const struct bt_gatt_attr *attr,
 				 u16_t value)
 {
-	nus_tx_started = (value == BT_GATT_CCC_NOTIFY) ? 1 : 0;
+	/* Only reports the aggregate of all peers, see on_write_ccc() */
+}
+
+static ssize_t on_write_ccc(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+			    const void *buf, u16_t len, u16_t offset,
+			    u8_t flags)
+{
+	struct nus_conn_ctx *ctx = nus_ctx_get(conn);
+	ssize_t ret;
+
+	ret = bt_gatt_attr_write_ccc(conn, attr, buf, len, offset, flags);
+	if (ret > 0 && ctx) {
+		if (sys_get_le16(buf) & NUS_CCC_MASK) {
+			NUS_STAT_INC(ctx, ccc_enabled);
+		} else {
+			NUS_STAT_INC(ctx, ccc_disabled);
+		}
+
+		nus_ctx_update(ctx);
+	}
+
+	return ret;
 }
 
 static ssize_t on_write_rx(struct bt_conn *conn, const struct bt_gatt_attr *attr,
 			const void *buf, u16_t len, u16_t offset,
 			u8_t flags)
 {
-	u8_t *value = attr->user_data;
-  
-	if (offset + len > sizeof(nus_rx)) {
+	struct nus_conn_ctx *ctx = nus_ctx_get(conn);
+	const u8_t *data = buf;
+	struct net_buf *rx_buf = NULL;
+#if defined(NUS_CREDIT_ON_RELEASE)
+	struct nus_rx_owner *owner;
+#endif
+#if defined(CONFIG_NUS_STATS)
+	u32_t start;
+#endif
+
+	if (!ctx) {
+		return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+	}
+
+	/* The attribute permissions only cover the Kconfig default */
+	if (!nus_conn_secured(conn)) {
+		NUS_STAT_INC(ctx, rx_rejected);
+		return BT_GATT_ERR(nus_sec_level >= BT_SECURITY_HIGH ?
+				   BT_ATT_ERR_AUTHENTICATION :
+				   BT_ATT_ERR_INSUFFICIENT_ENCRYPTION);
+	}
+
+#if defined(CONFIG_NUS_COMPRESS)
+	/* Capability frames take no credit and never reach the handler */
+	if (len == sizeof(struct nus_caps_frame) && !offset &&
+	    NUS_ATTR_CHAN(attr) == 0 &&
+	    sys_get_le16(data) == NUS_CAPS_MAGIC) {
+		if (atomic_get(&ctx->comp_state) == NUS_COMP_OFF) {
+			ctx->comp_caps = data[2] & NUS_CAP_COMPRESS;
+			atomic_set(&ctx->comp_state, NUS_COMP_SWITCHING);
+			k_sem_give(&nus_tx_sem);
+		}
+
+		return len;
+	}
+#endif
+
+#if !defined(CONFIG_NUS_RX_ZERO_COPY) && defined(CONFIG_NUS_BUF_POOL)
+	if (offset > NUS_RX_MAX_LEN) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+	}
+
+	/* Every write gets a buffer of its own, handlers may hold on to it */
+	if (len > CONFIG_NUS_BUF_SIZE) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+
+	rx_buf = net_buf_alloc(&nus_buf_pool, K_NO_WAIT);
+	if (!rx_buf) {
+#if defined(CONFIG_NUS_CREDITS)
+		/* The write is lost, keep the window of the peer intact */
+		nus_credit_return(ctx, 1);
+#endif
+		/* Pool exhausted, push back on the peer */
+		return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+	}
+
+#if defined(NUS_CREDIT_ON_RELEASE)
+	owner = net_buf_user_data(rx_buf);
+	owner->ctx = ctx - nus_ctx;
+	owner->gen = ctx->credit_gen;
+#endif
+
+	net_buf_add_mem(rx_buf, buf, len);
+	data = rx_buf->data;
+
+#if defined(CONFIG_NUS_RX_READ)
+	if (ctx->rx_buf) {
+		net_buf_unref(ctx->rx_buf);
+	}
+	ctx->rx_buf = rx_buf;
+#endif
+#elif !defined(CONFIG_NUS_RX_ZERO_COPY)
+	if (offset > sizeof(ctx->rx)) {
 		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
 	}
 
-	memcpy(value + offset, buf, len);
-	
+	if (offset + len > sizeof(ctx->rx)) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+
+	memcpy(ctx->rx + offset, buf, len);
+	ctx->rx_len = offset + len;
+	data = ctx->rx + offset;
+#endif
+
+	NUS_STAT_ADD(ctx, rx_bytes, len);
+	NUS_STAT_INC(ctx, rx_packets);
+
 	if (ble_nus.data_handler != NULL)
 	{
 	   ble_nus_data_evt_t evt;
 	   
 	   evt.conn             = conn;
 	   evt.rx_data.length   = len;
-	   evt.rx_data.p_data   = value;
+	   evt.rx_data.p_data   = data;
+	   evt.rx_data.buf      = rx_buf;
+	   evt.rx_data.chan     = NUS_ATTR_CHAN(attr);
+#if defined(CONFIG_NUS_STATS)
+	   start = k_cycle_get_32();
+#endif
 	   ble_nus.data_handler(&evt);
+#if defined(CONFIG_NUS_STATS)
+	   nus_hist_add(ctx->stats.write_to_handler, k_cycle_get_32() - start);
+#endif
 	}
 
+#if !defined(CONFIG_NUS_RX_ZERO_COPY) && defined(CONFIG_NUS_BUF_POOL) && \
+	!defined(CONFIG_NUS_RX_READ)
+	/* Not kept for reading back, only the handler may hold on to it */
+	net_buf_unref(rx_buf);
+#endif
+
+#if defined(CONFIG_NUS_CREDITS) && !defined(NUS_CREDIT_ON_RELEASE)
+	/* The handler is done with the data */
+	nus_credit_return(ctx, 1);
+#endif
+
 	return len;
 }
 
+#if defined(CONFIG_NUS_RX_READ)
 static ssize_t on_read_rx(struct bt_conn *conn, const struct bt_gatt_attr *attr,
 			 void *buf, u16_t len, u16_t offset)
 {
-	return bt_gatt_attr_read(conn, attr, buf, len, offset, &nus_rx, sizeof(nus_rx));
+#if defined(CONFIG_NUS_BUF_POOL)
+	struct nus_conn_ctx *ctx = nus_ctx_get(conn);
+
+	if (!ctx || !ctx->rx_buf) {
+		return bt_gatt_attr_read(conn, attr, buf, len, offset, NULL, 0);
+	}
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset,
+				 ctx->rx_buf->data, ctx->rx_buf->len);
+#else
+	struct nus_conn_ctx *ctx = nus_ctx_get(conn);
+
+	if (!ctx) {
+		return bt_gatt_attr_read(conn, attr, buf, len, offset, NULL, 0);
+	}
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, ctx->rx,
+				 ctx->rx_len);
+#endif
+}
+#endif /* CONFIG_NUS_RX_READ */
+
+#if CONFIG_NUS_SECURITY_LEVEL >= 3
+#define NUS_PERM_WRITE BT_GATT_PERM_WRITE_AUTHEN
+#elif CONFIG_NUS_SECURITY_LEVEL == 2
+#define NUS_PERM_WRITE BT_GATT_PERM_WRITE_ENCRYPT
+#else
+#define NUS_PERM_WRITE BT_GATT_PERM_WRITE
+#endif
+
+#if defined(CONFIG_NUS_RX_READ)
+#define NUS_RX_PROPS	(BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE | \
+			 BT_GATT_CHRC_WRITE_WITHOUT_RESP)
+#define NUS_RX_PERM	(BT_GATT_PERM_READ | NUS_PERM_WRITE)
+#define NUS_RX_READ	on_read_rx
+#else
+#define NUS_RX_PROPS	(BT_GATT_CHRC_WRITE | BT_GATT_CHRC_WRITE_WITHOUT_RESP)
+#define NUS_RX_PERM	NUS_PERM_WRITE
+#define NUS_RX_READ	NULL
+#endif
+
+#if defined(CONFIG_NUS_TX_INDICATE)
+#define NUS_TX_PROPS	(BT_GATT_CHRC_NOTIFY | BT_GATT_CHRC_INDICATE)
+#else
+#define NUS_TX_PROPS	BT_GATT_CHRC_NOTIFY
+#endif
+
+#define NUS_CCC(_n) {							\
+	.cfg = nus_ccc_cfg[_n],						\
+	.cfg_len = BT_GATT_CCC_MAX,					\
+	.cfg_changed = nus_ccc_cfg_changed,				\
+}
+
+static struct _bt_gatt_ccc nus_ccc[] = {
+	NUS_CCC(0),
+#if NUS_INSTANCES > 1
+	NUS_CCC(1),
+#endif
+#if NUS_INSTANCES > 2
+	NUS_CCC(2),
+#endif
+#if NUS_INSTANCES > 3
+	NUS_CCC(3),
+#endif
+};
+
+/* NUS Service Declaration, in the order of the NUS_ATTR indexes. The TX
+ * CCC is the same as BT_GATT_CCC, but with a write hook that sees each
+ * peer.
+ */
+#define NUS_ATTRS(_n) {							\
+	BT_GATT_PRIMARY_SERVICE(BT_UUID_NUS_N(_n)),			\
+	BT_GATT_CHARACTERISTIC(BT_UUID_NUS_RX_N(_n), NUS_RX_PROPS,	\
+			       NUS_RX_PERM, NUS_RX_READ, on_write_rx,	\
+			       NULL),					\
+	BT_GATT_CHARACTERISTIC(BT_UUID_NUS_TX_N(_n), NUS_TX_PROPS,	\
+			       BT_GATT_PERM_NONE, NULL, NULL, NULL),	\
+	BT_GATT_DESCRIPTOR(BT_UUID_GATT_CCC,				\
+			   BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,	\
+			   bt_gatt_attr_read_ccc, on_write_ccc,		\
+			   &nus_ccc[_n]),				\
+}
+
+BUILD_ASSERT_MSG(ARRAY_SIZE(((struct bt_gatt_attr[])NUS_ATTRS(0))) ==
+		 NUS_ATTR_COUNT, "NUS_ATTR indexes do not match the table");
+
+static struct bt_gatt_attr nus_attrs[NUS_INSTANCES][NUS_ATTR_COUNT] = {
+	NUS_ATTRS(0),
+#if NUS_INSTANCES > 1
+	NUS_ATTRS(1),
+#endif
+#if NUS_INSTANCES > 2
+	NUS_ATTRS(2),
+#endif
+#if NUS_INSTANCES > 3
+	NUS_ATTRS(3),
+#endif
+};
+
+static struct bt_gatt_service nus_svc[NUS_INSTANCES];
+
+static void nus_payload_len_report(struct bt_conn *conn)
+{
+	if (ble_nus.payload_len_handler != NULL) {
+		ble_nus.payload_len_handler(conn, nus_get_payload_len(conn));
+	}
+}
+
+#if defined(CONFIG_BT_GATT_CLIENT)
+static void nus_mtu_exchange_func(struct bt_conn *conn, u8_t err,
+				  struct bt_gatt_exchange_params *params)
+{
+	struct nus_conn_ctx *ctx = CONTAINER_OF(params, struct nus_conn_ctx,
+						mtu_params);
+
+	if (err) {
+		printk("NUS MTU exchange failed (err %u)\n", err);
+		ctx->mtu_state = NUS_MTU_IDLE;
+		return;
+	}
+
+	ctx->mtu_state = NUS_MTU_DONE;
+	nus_payload_len_report(conn);
+}
+
+static void nus_mtu_exchange(struct nus_conn_ctx *ctx)
+{
+	int err;
+
+	if (ctx->mtu_state != NUS_MTU_IDLE) {
+		return;
+	}
+
+	ctx->mtu_params.func = nus_mtu_exchange_func;
+
+	err = bt_gatt_exchange_mtu(ctx->conn, &ctx->mtu_params);
+	if (err) {
+		printk("NUS MTU exchange failed (err %d)\n", err);
+		return;
+	}
+
+	ctx->mtu_state = NUS_MTU_PENDING;
 }
+#endif /* CONFIG_BT_GATT_CLIENT */
+
+/* The PHY of each profile is not requested here: Zephyr has no per-link
+ * PHY API, the host moves to 2M on its own with CONFIG_BT_AUTO_PHY_UPDATE.
+ */
+static const struct bt_le_conn_param nus_link_bulk = {
+	.interval_min = 6,
+	.interval_max = 12,
+	.latency = 0,
+	.timeout = 400,
+};
 
-/* NUS Service Declaration */
-static struct bt_gatt_attr attrs[] = {
-	BT_GATT_PRIMARY_SERVICE(BT_UUID_NUS),
-	/* RX */
-	BT_GATT_CHARACTERISTIC(BT_UUID_NUS_RX, BT_GATT_CHRC_WRITE|BT_GATT_CHRC_WRITE_WITHOUT_RESP,
-	   BT_GATT_PERM_READ|BT_GATT_PERM_WRITE, on_read_rx, on_write_rx, &nus_rx),
-	/* TX */    
-	BT_GATT_CHARACTERISTIC(BT_UUID_NUS_TX, BT_GATT_CHRC_NOTIFY,
-	   BT_GATT_PERM_NONE, NULL, NULL, NULL),
-	BT_GATT_CCC(nus_ccc_cfg, nus_ccc_cfg_changed)
+static const struct bt_le_conn_param nus_link_low_power = {
+	.interval_min = 320,
+	.interval_max = 400,
+	.latency = 4,
+	.timeout = 600,
 };
 
-static struct bt_gatt_service nus_svc = BT_GATT_SERVICE(attrs);
+static const struct bt_le_conn_param *nus_link_param(nus_link_profile_t profile)
+{
+	switch (profile) {
+	case NUS_LINK_PROFILE_BULK:
+		return &nus_link_bulk;
+	case NUS_LINK_PROFILE_LOW_POWER:
+		return &nus_link_low_power;
+	default:
+		return NULL;
+	}
+}
 
-s32_t nus_init(ble_nus_init_t *p_init)
+static void nus_link_profile_apply(struct nus_conn_ctx *ctx)
 {
-    if (p_init->data_handler == NULL)
-    {
-        return -1;
-    }
-    else
-    {
-        ble_nus.data_handler = p_init->data_handler;
-    }
-    
-	return bt_gatt_service_register(&nus_svc);
+	const struct bt_le_conn_param *param = nus_link_param(ctx->link_profile);
+	int err;
+
+	if (param == NULL) {
+		return;
+	}
+
+	err = bt_conn_le_param_update(ctx->conn, param);
+	if (err) {
+		printk("NUS link profile %u failed (err %d)\n",
+		       ctx->link_profile, err);
+	}
 }
 
-s32_t nus_notify(struct bt_conn *conn, u8_t tx)
+static void nus_le_param_updated(struct bt_conn *conn, u16_t interval,
+				 u16_t latency, u16_t timeout)
 {
-    u8_t tx_char = tx;
-    
-	if (!nus_tx_started) 
-	{
-		return -1;
+	if (!nus_ctx_get(conn)) {
+		return;
 	}
 
-	return bt_gatt_notify(conn, &attrs[4], &tx_char, sizeof(tx_char));
+	if (ble_nus.link_handler != NULL) {
+		ble_nus.link_handler(conn, interval, latency, timeout);
+	}
 }
 
+static void nus_connected(struct bt_conn *conn, u8_t err)
+{
+	struct nus_conn_ctx *ctx;
+
+	if (err) {
+		return;
+	}
+
+	for (ctx = nus_ctx; ctx < &nus_ctx[ARRAY_SIZE(nus_ctx)]; ctx++) {
+		if (!atomic_test_and_set_bit(&ctx->flags, NUS_CTX_BUSY)) {
+			break;
+		}
+	}
+
+	if (ctx == &nus_ctx[ARRAY_SIZE(nus_ctx)]) {
+		printk("NUS out of connection contexts\n");
+		return;
+	}
+
+	ctx->link_profile = ble_nus.link_profile;
+	atomic_clear_bit(&ctx->flags, NUS_CTX_READY);
+	ctx->connected_at = k_uptime_get_32();
+	ctx->ready_ms = 0;
+	ctx->first_tx_ms = UINT32_MAX;
+#if defined(CONFIG_NUS_TX_INDICATE)
+	atomic_set(&ctx->ind_state, NUS_IND_IDLE);
+#endif
+#if defined(CONFIG_NUS_STATS)
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+#endif
+#if !defined(CONFIG_NUS_RX_ZERO_COPY) && defined(CONFIG_NUS_BUF_POOL)
+	ctx->rx_buf = NULL;
+#elif !defined(CONFIG_NUS_RX_ZERO_COPY)
+	ctx->rx_len = 0;
+#endif
+#if defined(CONFIG_NUS_TX_QUEUE)
+	/* Whatever the previous link of this slot left behind is stale */
+	atomic_set(&ctx->tx_drop, atomic_get(&ctx->tx_head));
+#endif
+#if defined(CONFIG_NUS_TX_QUEUE) && defined(CONFIG_NUS_BUF_POOL)
+	atomic_set(&ctx->tx_buf_drop, atomic_get(&ctx->tx_buf_head));
+#endif
+#if defined(CONFIG_NUS_CREDITS)
+	/* Writes of the previous link return no credits to this one */
+	ctx->credit_gen++;
+	atomic_set(&ctx->credits_pending, 0);
+	ctx->credits_granted = 0;
+#endif
+#if defined(CONFIG_NUS_COMPRESS)
+	/* Plain data until the peer asks for more */
+	atomic_set(&ctx->comp_state, NUS_COMP_OFF);
+	atomic_set(&ctx->tx_direct, 0);
+	ctx->comp_len = 0;
+#endif
+	ctx->conn = bt_conn_ref(conn);
+
+	/* Open the slot to senders, the link holds the first reference */
+	atomic_set_bit(&ctx->flags, NUS_CTX_UP);
+	atomic_set(&ctx->refs, 1);
+
+	/* The LL data length and PHY are raised by the host on its own
+	 * (CONFIG_BT_DATA_LEN_UPDATE, CONFIG_BT_AUTO_PHY_UPDATE), the ATT
+	 * MTU has to be asked for.
+	 */
+#if defined(CONFIG_BT_GATT_CLIENT)
+	ctx->mtu_state = NUS_MTU_IDLE;
+	nus_mtu_exchange(ctx);
+#endif
+
+#if defined(CONFIG_BT_SMP)
+	if (nus_sec_level > BT_SECURITY_LOW) {
+		int ret = bt_conn_security(conn, nus_sec_level);
+
+		if (ret) {
+			printk("NUS security request failed (err %d)\n", ret);
+		}
+		return;
+	}
+#endif
+
+	/* No pairing to wait for, bonded peers may even be subscribed */
+	nus_link_profile_apply(ctx);
+	nus_ctx_update(ctx);
+}
+
+static void nus_disconnected(struct bt_conn *conn, u8_t reason)
+{
+	struct nus_conn_ctx *ctx = nus_ctx_get(conn);
+
+	if (!ctx) {
+		return;
+	}
+
+	/* No new references from here on; senders holding one finish their
+	 * current PDU, and the last of them releases the link.
+	 */
+	atomic_clear_bit(&ctx->flags, NUS_CTX_READY);
+	atomic_clear_bit(&ctx->flags, NUS_CTX_UP);
+	nus_ctx_put(ctx);
+
+#if defined(CONFIG_NUS_TX_QUEUE)
+	/* Let the drain thread return the queued buffers to the pool and
+	 * fail a pending batch
+	 */
+	k_sem_give(&nus_tx_sem);
+#endif
+}
+
+#if defined(CONFIG_BT_SMP)
+static void nus_security_changed(struct bt_conn *conn, bt_security_t level)
+{
+	struct nus_conn_ctx *ctx = nus_ctx_get(conn);
+
+	if (!ctx) {
+		return;
+	}
+
+	/* Peers that refuse ATT before pairing get a second chance */
+#if defined(CONFIG_BT_GATT_CLIENT)
+	nus_mtu_exchange(ctx);
+#endif
+	nus_payload_len_report(conn);
+
+	if (level < nus_sec_level) {
+		return;
+	}
+
+	nus_link_profile_apply(ctx);
+	nus_ctx_update(ctx);
+}
+#endif /* CONFIG_BT_SMP */
+
+static struct bt_conn_cb nus_conn_callbacks = {
+	.connected          = nus_connected,
+	.disconnected       = nus_disconnected,
+	.le_param_updated   = nus_le_param_updated,
+#if defined(CONFIG_BT_SMP)
+	.security_changed   = nus_security_changed,
+#endif
+};
+
+s32_t nus_init(ble_nus_init_t *p_init)
+{
+	s32_t err;
+	int i;
+
+    if (p_init->data_handler == NULL)
+    {
+        return -EINVAL;
+    }
+    else
+    {
+        ble_nus.data_handler = p_init->data_handler;
+        ble_nus.payload_len_handler = p_init->payload_len_handler;
+        ble_nus.link_profile = p_init->link_profile;
+        ble_nus.link_handler = p_init->link_handler;
+        ble_nus.ready_handler = p_init->ready_handler;
+    }
+
+	bt_conn_cb_register(&nus_conn_callbacks);
+
+	for (i = 0; i < NUS_INSTANCES; i++) {
+		nus_svc[i].attrs = nus_attrs[i];
+		nus_svc[i].attr_count = NUS_ATTR_COUNT;
+
+		err = bt_gatt_service_register(&nus_svc[i]);
+		if (err) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+s32_t nus_link_profile_set(struct bt_conn *conn, nus_link_profile_t profile)
+{
+	struct nus_conn_ctx *ctx;
+
+	if (profile > NUS_LINK_PROFILE_LOW_POWER) {
+		return -EINVAL;
+	}
+
+	ble_nus.link_profile = profile;
+
+	ctx = nus_ctx_hold_conn(conn);
+	if (ctx == NULL) {
+		return 0;
+	}
+
+	ctx->link_profile = profile;
+
+	/* Otherwise requested from security_changed */
+	if (nus_conn_secured(conn)) {
+		nus_link_profile_apply(ctx);
+	}
+
+	nus_ctx_put(ctx);
+
+	return 0;
+}
+
+s32_t nus_security_set(bt_security_t level)
+{
+	int i;
+
+	if (level < BT_SECURITY_LOW || level > BT_SECURITY_FIPS) {
+		return -EINVAL;
+	}
+
+#if !defined(CONFIG_BT_SMP)
+	if (level > BT_SECURITY_LOW) {
+		return -ENOTSUP;
+	}
+#endif
+
+	nus_sec_level = level;
+
+	/* Raise links that are already up, or let them go if they now qualify */
+	for (i = 0; i < ARRAY_SIZE(nus_ctx); i++) {
+		if (!nus_ctx_hold(&nus_ctx[i])) {
+			continue;
+		}
+
+#if defined(CONFIG_BT_SMP)
+		if (!nus_conn_secured(nus_ctx[i].conn)) {
+			bt_conn_security(nus_ctx[i].conn, level);
+		}
+#endif
+		nus_ctx_update(&nus_ctx[i]);
+
+		nus_ctx_put(&nus_ctx[i]);
+	}
+
+	return 0;
+}
+
+bt_security_t nus_security_get(void)
+{
+	return nus_sec_level;
+}
+
+u16_t nus_get_payload_len(struct bt_conn *conn)
+{
+	if (conn == NULL) {
+		return BT_ATT_DEFAULT_LE_MTU - 3;
+	}
+
+	/* Never exceed what fits into one of our own L2CAP TX buffers */
+	return min(bt_gatt_get_mtu(conn), CONFIG_BT_L2CAP_TX_MTU) - 3;
+}
+
+/* Whether the central takes len bytes at p, sent on instance 0 without
+ * the header of compression, for one of our control frames
+ */
+static bool nus_is_ctrl_frame(const u8_t *p, u16_t len)
+{
+#if defined(CONFIG_NUS_CREDITS)
+	if (len == sizeof(struct nus_credit_frame) &&
+	    sys_get_le16(p) == NUS_CREDIT_MAGIC) {
+		return true;
+	}
+#endif
+
+#if defined(CONFIG_NUS_COMPRESS)
+	if (len == sizeof(struct nus_caps_frame) &&
+	    sys_get_le16(p) == NUS_CAPS_MAGIC) {
+		return true;
+	}
+#endif
+
+	return false;
+}
+
+/* Bytes of application data at p for the next notification on instance
+ * 0, given n fit. Data that would pass for a control frame is split one
+ * byte earlier, the rest follows in the next notification.
+ */
+static u16_t nus_tx_cut(struct nus_conn_ctx *ctx, const u8_t *p, u16_t n)
+{
+#if defined(CONFIG_NUS_COMPRESS)
+	/* Data then starts with a NUS_COMP_HDR_* byte */
+	if (atomic_get(&ctx->comp_state) == NUS_COMP_ON) {
+		return n;
+	}
+#endif
+
+	return nus_is_ctrl_frame(p, n) ? n - 1 : n;
+}
+
+static s32_t nus_ctx_send_chunks(struct nus_conn_ctx *ctx,
+				 struct bt_conn *conn, u8_t chan,
+				 const u8_t *p, u16_t len)
+{
+	u16_t chunk = nus_get_payload_len(conn);
+	u16_t sent = 0;
+	int err;
+#if defined(CONFIG_NUS_COMPRESS)
+	u8_t frame[CONFIG_BT_L2CAP_TX_MTU - 3];
+	bool framed = false;
+#endif
+
+	if (!nus_ctx_chan_ready(ctx, chan)) {
+		return -ENOTCONN;
+	}
+
+#if defined(CONFIG_NUS_COMPRESS)
+	if (chan == 0) {
+		switch (atomic_get(&ctx->comp_state)) {
+		case NUS_COMP_SWITCHING:
+			/* The drain thread switches once we are out */
+			return -EAGAIN;
+		case NUS_COMP_ON:
+			frame[0] = NUS_COMP_HDR_RAW;
+			framed = true;
+			chunk--;
+			break;
+		default:
+			break;
+		}
+	}
+#endif
+
+	while (sent < len) {
+		u16_t n = min(chunk, len - sent);
+
+		if (chan == 0) {
+			n = nus_tx_cut(ctx, p + sent, n);
+		}
+
+#if defined(CONFIG_NUS_COMPRESS)
+		if (framed) {
+			memcpy(frame + 1, p + sent, n);
+			err = nus_ctx_tx(ctx, conn, chan, frame, n + 1);
+		} else
+#endif
+		{
+			err = nus_ctx_tx(ctx, conn, chan, p + sent, n);
+		}
+
+		if (err) {
+			nus_stat_tx_error(ctx, err);
+			/* Report the error only if nothing made it out */
+			return sent ? sent : err;
+		}
+
+		NUS_STAT_ADD(ctx, tx_bytes, n);
+		NUS_STAT_INC(ctx, tx_packets);
+		sent += n;
+	}
+
+	return sent;
+}
+
+static s32_t nus_ctx_send(struct nus_conn_ctx *ctx, struct bt_conn *conn,
+			  u8_t chan, const u8_t *p, u16_t len)
+{
+#if defined(CONFIG_NUS_COMPRESS)
+	s32_t ret;
+
+	if (chan == 0) {
+		atomic_inc(&ctx->tx_direct);
+		ret = nus_ctx_send_chunks(ctx, conn, chan, p, len);
+
+		if (atomic_dec(&ctx->tx_direct) == 1 &&
+		    atomic_get(&ctx->comp_state) == NUS_COMP_SWITCHING) {
+			k_sem_give(&nus_tx_sem);
+		}
+
+		return ret;
+	}
+#endif
+
+	return nus_ctx_send_chunks(ctx, conn, chan, p, len);
+}
+
+s32_t nus_chan_send(struct bt_conn *conn, u8_t chan, const void *data,
+		    u16_t len)
+{
+	struct nus_conn_ctx *ctx;
+	bool any = false;
+	s32_t ret = -ENOTCONN;
+	s32_t sent;
+	int i;
+
+	if (chan >= NUS_INSTANCES) {
+		return -EINVAL;
+	}
+
+	if (conn) {
+		ctx = nus_ctx_hold_conn(conn);
+		if (!ctx) {
+			return -ENOTCONN;
+		}
+
+		sent = nus_ctx_send(ctx, conn, chan, data, len);
+		nus_ctx_put(ctx);
+
+		return sent;
+	}
+
+	/* Fan out to every subscribed peer, report the worst result */
+	for (i = 0; i < ARRAY_SIZE(nus_ctx); i++) {
+		ctx = &nus_ctx[i];
+
+		if (!nus_ctx_hold(ctx)) {
+			continue;
+		}
+
+		if (!nus_ctx_chan_ready(ctx, chan)) {
+			nus_ctx_put(ctx);
+			continue;
+		}
+
+		sent = nus_ctx_send(ctx, ctx->conn, chan, data, len);
+		nus_ctx_put(ctx);
+
+		if (!any || sent < ret) {
+			ret = sent;
+			any = true;
+		}
+	}
+
+	return ret;
+}
+
+s32_t nus_send(struct bt_conn *conn, const void *data, u16_t len)
+{
+	return nus_chan_send(conn, 0, data, len);
+}
+
+s32_t nus_notify(struct bt_conn *conn, u8_t tx)
+{
+	s32_t ret = nus_send(conn, &tx, sizeof(tx));
+
+	return (ret == sizeof(tx)) ? 0 : ret;
+}
+
+u8_t nus_ready_count(void)
+{
+	u8_t count = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(nus_ctx); i++) {
+		if (atomic_test_bit(&nus_ctx[i].flags, NUS_CTX_READY)) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+s32_t nus_stats_get(struct bt_conn *conn, struct nus_stats *stats)
+{
+	struct nus_conn_ctx *ctx = nus_ctx_hold_conn(conn);
+
+	if (!ctx) {
+		return -ENOTCONN;
+	}
+
+#if defined(CONFIG_NUS_STATS)
+	stats->tx_bytes = atomic_get(&ctx->stats.tx_bytes);
+	stats->tx_packets = atomic_get(&ctx->stats.tx_packets);
+	stats->tx_errors = atomic_get(&ctx->stats.tx_errors);
+	stats->tx_err_nomem = atomic_get(&ctx->stats.tx_err_nomem);
+	stats->tx_err_notconn = atomic_get(&ctx->stats.tx_err_notconn);
+	stats->rx_bytes = atomic_get(&ctx->stats.rx_bytes);
+	stats->rx_packets = atomic_get(&ctx->stats.rx_packets);
+	stats->rx_rejected = atomic_get(&ctx->stats.rx_rejected);
+	stats->ccc_enabled = atomic_get(&ctx->stats.ccc_enabled);
+	stats->ccc_disabled = atomic_get(&ctx->stats.ccc_disabled);
+	stats->tx_queue_hwm = ctx->stats.tx_queue_hwm;
+	stats->comp_in_bytes = ctx->stats.comp_in_bytes;
+	stats->comp_out_bytes = ctx->stats.comp_out_bytes;
+	stats->comp_cycles = ctx->stats.comp_cycles;
+	memcpy(stats->enqueue_to_air, ctx->stats.enqueue_to_air,
+	       sizeof(stats->enqueue_to_air));
+	memcpy(stats->write_to_handler, ctx->stats.write_to_handler,
+	       sizeof(stats->write_to_handler));
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+	stats->ready_ms = ctx->ready_ms;
+	stats->first_tx_ms = ctx->first_tx_ms;
+
+	nus_ctx_put(ctx);
+
+	return 0;
+}
+
+u32_t nus_stats_bucket_us(u8_t bucket)
+{
+	if (bucket >= NUS_STATS_HIST_BUCKETS - 1) {
+		return UINT32_MAX;
+	}
+
+	return (u32_t)(((u64_t)1 << bucket) * USEC_PER_SEC /
+		       sys_clock_hw_cycles_per_sec);
+}
+
+#if defined(CONFIG_NUS_TX_QUEUE)
+static u32_t nus_tx_space_ctx(struct nus_conn_ctx *ctx)
+{
+	return CONFIG_NUS_TX_RING_SIZE -
+	       (atomic_get(&ctx->tx_head) - atomic_get(&ctx->tx_tail));
+}
+
+static void nus_tx_put(struct nus_conn_ctx *ctx, const u8_t *p, u16_t len)
+{
+	u32_t head = atomic_get(&ctx->tx_head);
+	u32_t idx = head & (CONFIG_NUS_TX_RING_SIZE - 1);
+	u32_t first = min(len, CONFIG_NUS_TX_RING_SIZE - idx);
+
+	memcpy(&ctx->tx_ring[idx], p, first);
+	memcpy(ctx->tx_ring, p + first, len - first);
+
+	/* Publish the bytes only once they are in the ring */
+	atomic_set(&ctx->tx_head, head + len);
+
+#if defined(CONFIG_NUS_STATS)
+	if (head + len - atomic_get(&ctx->tx_tail) > ctx->stats.tx_queue_hwm) {
+		ctx->stats.tx_queue_hwm = head + len - atomic_get(&ctx->tx_tail);
+	}
+
+	/* Time one enqueue at a time, until its last byte has been sent */
+	if (!atomic_get(&ctx->stats.tx_mark_set)) {
+		ctx->stats.tx_mark = head + len;
+		ctx->stats.tx_mark_cycles = k_cycle_get_32();
+		atomic_set(&ctx->stats.tx_mark_set, 1);
+	}
+#endif
+}
+
+u16_t nus_tx_enqueue(struct bt_conn *conn, const void *data, u16_t len)
+{
+	struct nus_conn_ctx *ctx;
+	u32_t ready = 0;
+	int i;
+
+	if (conn) {
+		ctx = nus_ctx_hold_conn(conn);
+		if (!ctx) {
+			return 0;
+		}
+
+		len = min(len, nus_tx_space_ctx(ctx));
+		if (len) {
+			nus_tx_put(ctx, data, len);
+			k_sem_give(&nus_tx_sem);
+		}
+
+		nus_ctx_put(ctx);
+
+		return len;
+	}
+
+	/* Fan out: every ready ring gets the same bytes, so queue only what
+	 * fits into all of them. The links are held throughout, none of
+	 * them can be replaced between the two passes.
+	 */
+	for (i = 0; i < ARRAY_SIZE(nus_ctx); i++) {
+		if (!nus_ctx_hold(&nus_ctx[i])) {
+			continue;
+		}
+
+		if (!atomic_test_bit(&nus_ctx[i].flags, NUS_CTX_READY)) {
+			nus_ctx_put(&nus_ctx[i]);
+			continue;
+		}
+
+		len = min(len, nus_tx_space_ctx(&nus_ctx[i]));
+		ready |= BIT(i);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(nus_ctx); i++) {
+		if (ready & BIT(i)) {
+			if (len) {
+				nus_tx_put(&nus_ctx[i], data, len);
+			}
+
+			nus_ctx_put(&nus_ctx[i]);
+		}
+	}
+
+	if (!len || !ready) {
+		return 0;
+	}
+
+	k_sem_give(&nus_tx_sem);
+
+	return len;
+}
+
+u16_t nus_tx_space(struct bt_conn *conn)
+{
+	struct nus_conn_ctx *ctx = nus_ctx_hold_conn(conn);
+	u16_t space;
+
+	if (!ctx) {
+		return 0;
+	}
+
+	space = nus_tx_space_ctx(ctx);
+	nus_ctx_put(ctx);
+
+	return space;
+}
+
+/* Send one PDU of the TX queue, drain thread only. With indications the
+ * PDU is staged while the previous one waits for its confirmation, so
+ * the link never idles for a round trip; -EBUSY once both are taken.
+ */
+static int nus_tx_pdu(struct nus_conn_ctx *ctx, struct bt_conn *conn,
+		      const void *data, u16_t len)
+{
+#if defined(CONFIG_NUS_TX_INDICATE)
+	int err;
+
+	if (!nus_ctx_indicating(ctx, 0)) {
+		return nus_ctx_tx(ctx, conn, 0, data, len);
+	}
+
+	while (1) {
+		switch (atomic_get(&ctx->ind_state)) {
+		case NUS_IND_IDLE:
+			return nus_ctx_tx(ctx, conn, 0, data, len);
+		case NUS_IND_BUSY:
+			memcpy(ctx->ind_stage, data, len);
+			ctx->ind_stage_len = len;
+
+			if (atomic_cas(&ctx->ind_state, NUS_IND_BUSY,
+				       NUS_IND_STAGED)) {
+				return 0;
+			}
+
+			/* Confirmed meanwhile, send it right away */
+			continue;
+		case NUS_IND_HELD:
+			atomic_set(&ctx->ind_state, NUS_IND_BUSY);
+
+			err = nus_ind_send(ctx, conn, 0, ctx->ind_stage,
+					   ctx->ind_stage_len);
+			if (err) {
+				atomic_set(&ctx->ind_state, NUS_IND_HELD);
+				return err;
+			}
+
+			continue;
+		default:
+			return -EBUSY;
+		}
+	}
+#else
+	return nus_ctx_tx(ctx, conn, 0, data, len);
+#endif
+}
+
+/* Plain data that fits into one PDU of the TX queue */
+static u16_t nus_tx_payload_len(struct nus_conn_ctx *ctx, struct bt_conn *conn)
+{
+#if defined(CONFIG_NUS_COMPRESS)
+	if (atomic_get(&ctx->comp_state) == NUS_COMP_ON) {
+		return nus_get_payload_len(conn) - 1;
+	}
+#endif
+
+	return nus_get_payload_len(conn);
+}
+
+u16_t nus_tx_data_len(struct bt_conn *conn)
+{
+	struct nus_conn_ctx *ctx = nus_ctx_hold_conn(conn);
+	u16_t len;
+
+	if (!ctx) {
+		return 0;
+	}
+
+	len = nus_tx_payload_len(ctx, conn);
+	nus_ctx_put(ctx);
+
+	return len;
+}
+
+/* Send one PDU of plain data of the TX queue, with the header the peer
+ * expects
+ */
+static int nus_tx_data(struct nus_conn_ctx *ctx, struct bt_conn *conn,
+		       const void *data, u16_t len)
+{
+#if defined(CONFIG_NUS_COMPRESS)
+	u8_t frame[CONFIG_BT_L2CAP_TX_MTU - 3];
+
+	if (atomic_get(&ctx->comp_state) == NUS_COMP_ON) {
+		frame[0] = NUS_COMP_HDR_RAW;
+		memcpy(frame + 1, data, len);
+
+		return nus_tx_pdu(ctx, conn, frame, len + 1);
+	}
+#endif
+
+	return nus_tx_pdu(ctx, conn, data, len);
+}
+
+/* Data of the ring up to tail has been taken out */
+static void nus_tx_consumed(struct nus_conn_ctx *ctx, u32_t tail)
+{
+	atomic_set(&ctx->tx_tail, tail);
+
+#if defined(CONFIG_NUS_STATS)
+	if (atomic_get(&ctx->stats.tx_mark_set) &&
+	    (s32_t)(tail - ctx->stats.tx_mark) >= 0) {
+		nus_hist_add(ctx->stats.enqueue_to_air,
+			     k_cycle_get_32() - ctx->stats.tx_mark_cycles);
+		atomic_set(&ctx->stats.tx_mark_set, 0);
+	}
+#endif
+}
+
+#if defined(CONFIG_NUS_COMPRESS)
+/* Send the ring as compressed blocks, same results as nus_tx_drain_one().
+ * The encoder cannot take a block back, so a block leaves the ring as soon
+ * as it is encoded and waits in comp_pdu until it could be sent.
+ */
+static int nus_tx_drain_comp(struct nus_conn_ctx *ctx, struct bt_conn *conn,
+			     u32_t tail, u32_t avail)
+{
+	u32_t idx = tail & (CONFIG_NUS_TX_RING_SIZE - 1);
+	u16_t room, in, taken;
+	int err;
+#if defined(CONFIG_NUS_STATS)
+	u32_t start;
+#endif
+
+	if (!nus_ctx_ready(ctx)) {
+		return 0;
+	}
+
+	if (!ctx->comp_len && avail) {
+#if defined(CONFIG_NUS_STATS)
+		start = k_cycle_get_32();
+#endif
+		room = nus_get_payload_len(conn);
+		ctx->comp_pdu[0] = NUS_COMP_HDR_LZ;
+		ctx->comp_len = 1;
+
+		/* Up to the end of the ring, then on from its start */
+		in = min(avail, CONFIG_NUS_TX_RING_SIZE - idx);
+		ctx->comp_len += nus_comp_encode(&ctx->comp_enc,
+						 &ctx->tx_ring[idx], &in,
+						 ctx->comp_pdu + ctx->comp_len,
+						 room - ctx->comp_len);
+		taken = in;
+
+		if (idx + taken == CONFIG_NUS_TX_RING_SIZE && avail > taken) {
+			in = min(avail - taken, UINT16_MAX);
+			ctx->comp_len += nus_comp_encode(&ctx->comp_enc,
+							 ctx->tx_ring, &in,
+							 ctx->comp_pdu + ctx->comp_len,
+							 room - ctx->comp_len);
+			taken += in;
+		}
+
+#if defined(CONFIG_NUS_STATS)
+		ctx->stats.comp_in_bytes += taken;
+		ctx->stats.comp_out_bytes += ctx->comp_len;
+		ctx->stats.comp_cycles += k_cycle_get_32() - start;
+#endif
+
+		nus_tx_consumed(ctx, tail + taken);
+	}
+
+	if (!ctx->comp_len) {
+		return 0;
+	}
+
+	err = nus_tx_pdu(ctx, conn, ctx->comp_pdu, ctx->comp_len);
+	if (err) {
+		nus_stat_tx_error(ctx, err);
+		return err;
+	}
+
+	NUS_STAT_ADD(ctx, tx_bytes, ctx->comp_len);
+	NUS_STAT_INC(ctx, tx_packets);
+	ctx->comp_len = 0;
+
+	return 1;
+}
+#endif
+
+/* Send one PDU worth of the ring of a link. Returns 1 if something was
+ * sent, 0 if there is nothing to send and a negative error otherwise;
+ * data is never dropped on errors.
+ */
+static int nus_tx_drain_one(struct nus_conn_ctx *ctx, struct bt_conn *conn)
+{
+	u8_t chunk[CONFIG_BT_L2CAP_TX_MTU - 3];
+	u32_t tail = atomic_get(&ctx->tx_tail);
+	u32_t drop = atomic_get(&ctx->tx_drop);
+	u32_t avail, idx;
+	const u8_t *p;
+	u16_t n;
+	int err;
+
+	if ((s32_t)(drop - tail) > 0) {
+		tail = drop;
+		atomic_set(&ctx->tx_tail, tail);
+	}
+
+	avail = atomic_get(&ctx->tx_head) - tail;
+
+#if defined(CONFIG_NUS_COMPRESS)
+	if (atomic_get(&ctx->comp_state) == NUS_COMP_ON) {
+		return nus_tx_drain_comp(ctx, conn, tail, avail);
+	}
+#endif
+
+	if (!avail || !nus_ctx_ready(ctx)) {
+		return 0;
+	}
+
+	idx = tail & (CONFIG_NUS_TX_RING_SIZE - 1);
+	n = min(avail, nus_get_payload_len(conn));
+
+	if (idx + n <= CONFIG_NUS_TX_RING_SIZE) {
+		p = &ctx->tx_ring[idx];
+	} else {
+		/* Coalesce across the wrap so the PDU stays full */
+		u32_t first = CONFIG_NUS_TX_RING_SIZE - idx;
+
+		memcpy(chunk, &ctx->tx_ring[idx], first);
+		memcpy(chunk + first, ctx->tx_ring, n - first);
+		p = chunk;
+	}
+
+	n = nus_tx_cut(ctx, p, n);
+
+	err = nus_tx_pdu(ctx, conn, p, n);
+	if (err) {
+		nus_stat_tx_error(ctx, err);
+		return err;
+	}
+
+	NUS_STAT_ADD(ctx, tx_bytes, n);
+	NUS_STAT_INC(ctx, tx_packets);
+	nus_tx_consumed(ctx, tail + n);
+
+	return 1;
+}
+
+#if defined(CONFIG_NUS_BUF_POOL)
+struct net_buf *nus_buf_alloc(s32_t timeout)
+{
+	struct net_buf *buf = net_buf_alloc(&nus_buf_pool, timeout);
+
+#if defined(NUS_CREDIT_ON_RELEASE)
+	if (buf) {
+		((struct nus_rx_owner *)net_buf_user_data(buf))->ctx = UINT8_MAX;
+	}
+#endif
+
+	return buf;
+}
+
+static void nus_tx_buf_put(struct nus_conn_ctx *ctx, struct net_buf *buf,
+			   bool pdu)
+{
+	u32_t head = atomic_get(&ctx->tx_buf_head);
+
+	ctx->tx_bufs[head & (CONFIG_NUS_TX_BUF_QUEUE_LEN - 1)] = net_buf_ref(buf);
+	ctx->tx_buf_pdu[head & (CONFIG_NUS_TX_BUF_QUEUE_LEN - 1)] = pdu;
+
+	/* Publish the entry only once it is filled in */
+	atomic_set(&ctx->tx_buf_head, head + 1);
+}
+
+static s32_t nus_tx_enqueue_buf_pdu(struct bt_conn *conn, struct net_buf *buf,
+				    bool pdu)
+{
+	struct nus_conn_ctx *ctx;
+	u32_t queue = 0;
+	s32_t err = 0;
+	int i;
+
+	if (!buf->len) {
+		return -EINVAL;
+	}
+
+	/* All or nothing, like the byte rings */
+	for (i = 0; i < ARRAY_SIZE(nus_ctx); i++) {
+		ctx = &nus_ctx[i];
+
+		if (!nus_ctx_hold(ctx)) {
+			continue;
+		}
+
+		if (conn ? ctx->conn != conn :
+			   !atomic_test_bit(&ctx->flags, NUS_CTX_READY)) {
+			nus_ctx_put(ctx);
+			continue;
+		}
+
+		queue |= BIT(i);
+
+		if (atomic_get(&ctx->tx_buf_head) - atomic_get(&ctx->tx_buf_tail) ==
+		    CONFIG_NUS_TX_BUF_QUEUE_LEN) {
+			err = -ENOMEM;
+			break;
+		}
+	}
+
+	if (!queue) {
+		return -ENOTCONN;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(nus_ctx); i++) {
+		if (queue & BIT(i)) {
+			if (!err) {
+				nus_tx_buf_put(&nus_ctx[i], buf, pdu);
+			}
+
+			nus_ctx_put(&nus_ctx[i]);
+		}
+	}
+
+	if (!err) {
+		k_sem_give(&nus_tx_sem);
+	}
+
+	return err;
+}
+
+s32_t nus_tx_enqueue_buf(struct bt_conn *conn, struct net_buf *buf)
+{
+	return nus_tx_enqueue_buf_pdu(conn, buf, false);
+}
+
+s32_t nus_tx_enqueue_pdu(struct bt_conn *conn, struct net_buf *buf)
+{
+	/* It cannot be split to tell it from a control frame */
+	if (nus_is_ctrl_frame(buf->data, buf->len)) {
+		return -EINVAL;
+	}
+
+	return nus_tx_enqueue_buf_pdu(conn, buf, true);
+}
+
+/* Release the queued buffers before upto, drain thread only */
+static void nus_tx_buf_flush(struct nus_conn_ctx *ctx, u32_t upto)
+{
+	u32_t tail = atomic_get(&ctx->tx_buf_tail);
+
+	while ((s32_t)(upto - tail) > 0) {
+		net_buf_unref(ctx->tx_bufs[tail & (CONFIG_NUS_TX_BUF_QUEUE_LEN - 1)]);
+		ctx->tx_buf_off = 0;
+		tail++;
+	}
+
+	atomic_set(&ctx->tx_buf_tail, tail);
+}
+
+/* Send one PDU worth of the oldest queued buffer, same results as
+ * nus_tx_drain_one().
+ */
+static int nus_tx_drain_buf(struct nus_conn_ctx *ctx, struct bt_conn *conn)
+{
+	struct net_buf *buf;
+	u32_t tail;
+	u16_t n;
+	int err;
+
+	nus_tx_buf_flush(ctx, atomic_get(&ctx->tx_buf_drop));
+
+	tail = atomic_get(&ctx->tx_buf_tail);
+	if (tail == atomic_get(&ctx->tx_buf_head) || !nus_ctx_ready(ctx)) {
+		return 0;
+	}
+
+	buf = ctx->tx_bufs[tail & (CONFIG_NUS_TX_BUF_QUEUE_LEN - 1)];
+	n = min(buf->len - ctx->tx_buf_off, nus_tx_payload_len(ctx, conn));
+	n = nus_tx_cut(ctx, buf->data + ctx->tx_buf_off, n);
+
+	/* The notification shrank since it was queued, say by the header
+	 * of compression; both halves would be garbage to the peer
+	 */
+	if (ctx->tx_buf_pdu[tail & (CONFIG_NUS_TX_BUF_QUEUE_LEN - 1)] &&
+	    n < buf->len) {
+		nus_stat_tx_error(ctx, -EMSGSIZE);
+		nus_tx_buf_flush(ctx, tail + 1);
+		return 1;
+	}
+
+	/* Straight from the buffer, it is shared and never modified */
+	err = nus_tx_data(ctx, conn, buf->data + ctx->tx_buf_off, n);
+	if (err) {
+		nus_stat_tx_error(ctx, err);
+		return err;
+	}
+
+	NUS_STAT_ADD(ctx, tx_bytes, n);
+	NUS_STAT_INC(ctx, tx_packets);
+
+	ctx->tx_buf_off += n;
+	if (ctx->tx_buf_off == buf->len) {
+		nus_tx_buf_flush(ctx, tail + 1);
+	}
+
+	return 1;
+}
+#endif /* CONFIG_NUS_BUF_POOL */
+
+s32_t nus_send_batch(struct bt_conn *conn, const struct nus_iovec *vec,
+		     size_t cnt, nus_batch_cb_t cb, void *user_data)
+{
+	struct nus_conn_ctx *ctx;
+
+	if (!cnt) {
+		return -EINVAL;
+	}
+
+	ctx = nus_ctx_hold_conn(conn);
+	if (!ctx) {
+		return -ENOTCONN;
+	}
+
+	if (!atomic_cas(&ctx->batch_state, NUS_BATCH_IDLE, NUS_BATCH_CLAIMED)) {
+		nus_ctx_put(ctx);
+		return -EBUSY;
+	}
+
+	ctx->batch_conn = bt_conn_ref(conn);
+	ctx->batch_vec = vec;
+	ctx->batch_cnt = cnt;
+	ctx->batch_idx = 0;
+	ctx->batch_off = 0;
+	ctx->batch_cb = cb;
+	ctx->batch_user_data = user_data;
+
+	atomic_set(&ctx->batch_state, NUS_BATCH_QUEUED);
+	k_sem_give(&nus_tx_sem);
+
+	nus_ctx_put(ctx);
+
+	return 0;
+}
+
+static void nus_batch_complete(struct nus_conn_ctx *ctx, s32_t err)
+{
+	struct bt_conn *conn = ctx->batch_conn;
+	nus_batch_cb_t cb = ctx->batch_cb;
+	void *user_data = ctx->batch_user_data;
+
+	/* Free the slot first, the callback may queue the next batch */
+	ctx->batch_conn = NULL;
+	atomic_set(&ctx->batch_state, NUS_BATCH_IDLE);
+
+	if (cb) {
+		cb(conn, err, user_data);
+	}
+
+	bt_conn_unref(conn);
+}
+
+/* All PDUs of the batch are out. With indications it only completes once
+ * the peer confirmed them; the confirmation wakes the drain thread again.
+ */
+static void nus_batch_sent(struct nus_conn_ctx *ctx)
+{
+#if defined(CONFIG_NUS_TX_INDICATE)
+	if (atomic_get(&ctx->ind_state) != NUS_IND_IDLE) {
+		return;
+	}
+#endif
+
+	nus_batch_complete(ctx, 0);
+}
+
+/* Send the next PDU of the pending batch, same results as
+ * nus_tx_drain_one().
+ */
+static int nus_tx_drain_batch(struct nus_conn_ctx *ctx, struct bt_conn *conn)
+{
+	const struct nus_iovec *vec;
+	u16_t n;
+	int err;
+
+	if (atomic_get(&ctx->batch_state) != NUS_BATCH_QUEUED) {
+		return 0;
+	}
+
+	if (ctx->batch_conn != conn) {
+		/* Queued for a link this slot no longer has */
+		nus_batch_complete(ctx, -ENOTCONN);
+		return 0;
+	}
+
+	if (!nus_ctx_ready(ctx)) {
+		return 0;
+	}
+
+	if (ctx->batch_idx == ctx->batch_cnt) {
+		nus_batch_sent(ctx);
+		return 0;
+	}
+
+	vec = &ctx->batch_vec[ctx->batch_idx];
+	n = min(vec->iov_len - ctx->batch_off, nus_tx_payload_len(ctx, conn));
+	n = nus_tx_cut(ctx, (const u8_t *)vec->iov_base + ctx->batch_off, n);
+
+	if (n) {
+		err = nus_tx_data(ctx, conn,
+				 (const u8_t *)vec->iov_base + ctx->batch_off, n);
+		if (err) {
+			nus_stat_tx_error(ctx, err);
+
+			if (err != -ENOMEM && err != -EBUSY) {
+				nus_batch_complete(ctx, err);
+			}
+
+			return err;
+		}
+
+		NUS_STAT_ADD(ctx, tx_bytes, n);
+		NUS_STAT_INC(ctx, tx_packets);
+	}
+
+	ctx->batch_off += n;
+	if (ctx->batch_off == vec->iov_len) {
+		ctx->batch_off = 0;
+		ctx->batch_idx++;
+	}
+
+	if (ctx->batch_idx == ctx->batch_cnt) {
+		nus_batch_sent(ctx);
+	}
+
+	return 1;
+}
+
+#if defined(CONFIG_NUS_CREDITS)
+/* Return the collected credits of a link in one frame */
+static int nus_tx_drain_credits(struct nus_conn_ctx *ctx, struct bt_conn *conn)
+{
+	struct nus_credit_frame frame;
+	atomic_val_t credits = atomic_get(&ctx->credits_pending);
+	int err;
+
+	if (credits < CONFIG_NUS_CREDITS_THRESHOLD || !nus_ctx_ready(ctx)) {
+		return 0;
+	}
+
+	credits = min(credits, UINT16_MAX);
+	frame.magic = sys_cpu_to_le16(NUS_CREDIT_MAGIC);
+	frame.credits = sys_cpu_to_le16(credits);
+
+	err = nus_tx_pdu(ctx, conn, &frame, sizeof(frame));
+	if (err) {
+		nus_stat_tx_error(ctx, err);
+		return err;
+	}
+
+	atomic_sub(&ctx->credits_pending, credits);
+
+	return 1;
+}
+#endif
+
+#if defined(CONFIG_NUS_COMPRESS)
+/* Answer a capability frame of the peer and switch the framing. Direct
+ * sends in flight still use the old one, so wait until they are done.
+ */
+static int nus_tx_drain_caps(struct nus_conn_ctx *ctx, struct bt_conn *conn)
+{
+	struct nus_caps_frame frame;
+	int err;
+
+	if (atomic_get(&ctx->comp_state) != NUS_COMP_SWITCHING ||
+	    atomic_get(&ctx->tx_direct) || !nus_ctx_ready(ctx)) {
+		return 0;
+	}
+
+	frame.magic = sys_cpu_to_le16(NUS_CAPS_MAGIC);
+	frame.caps = ctx->comp_caps;
+
+	err = nus_tx_pdu(ctx, conn, &frame, sizeof(frame));
+	if (err) {
+		nus_stat_tx_error(ctx, err);
+		return err;
+	}
+
+	nus_comp_enc_init(&ctx->comp_enc);
+	atomic_set(&ctx->comp_state, (ctx->comp_caps & NUS_CAP_COMPRESS) ?
+				     NUS_COMP_ON : NUS_COMP_OFF);
+
+	NUS_LOG(DATA, INF, "capabilities 0x%02x accepted", ctx->comp_caps);
+
+	return 1;
+}
+#endif
+
+/* Send one PDU of a link: a capability answer goes first since it changes
+ * the framing of everything after it, then returned credits so that the
+ * peer keeps writing, then the ring, the queued buffers and the batch.
+ */
+static int nus_tx_drain_ctx(struct nus_conn_ctx *ctx, struct bt_conn *conn)
+{
+	int ret;
+
+#if defined(CONFIG_NUS_COMPRESS)
+	ret = nus_tx_drain_caps(ctx, conn);
+	if (ret) {
+		return ret;
+	}
+#endif
+
+#if defined(CONFIG_NUS_CREDITS)
+	ret = nus_tx_drain_credits(ctx, conn);
+	if (ret) {
+		return ret;
+	}
+#endif
+
+	ret = nus_tx_drain_one(ctx, conn);
+	if (ret) {
+		return ret;
+	}
+
+#if defined(CONFIG_NUS_BUF_POOL)
+	ret = nus_tx_drain_buf(ctx, conn);
+	if (ret) {
+		return ret;
+	}
+#endif
+
+	return nus_tx_drain_batch(ctx, conn);
+}
+
+/* Release what is queued on a released slot and free it for the next
+ * link, drain thread only. The slot stays claimed until then, so nothing
+ * can be queued on it meanwhile.
+ */
+static void nus_tx_flush_ctx(struct nus_conn_ctx *ctx)
+{
+	if (!atomic_test_bit(&ctx->flags, NUS_CTX_FLUSH)) {
+		return;
+	}
+
+#if defined(CONFIG_NUS_BUF_POOL)
+	nus_tx_buf_flush(ctx, atomic_get(&ctx->tx_buf_head));
+#endif
+
+	if (atomic_get(&ctx->batch_state) == NUS_BATCH_QUEUED) {
+		nus_batch_complete(ctx, -ENOTCONN);
+	}
+
+	atomic_clear_bit(&ctx->flags, NUS_CTX_FLUSH);
+	atomic_clear_bit(&ctx->flags, NUS_CTX_BUSY);
+}
+
+static void nus_tx_thread(void *p1, void *p2, void *p3)
+{
+	struct nus_conn_ctx *ctx;
+	s32_t backoff = 1;
+	bool pending, nomem;
+	int i, ret;
+
+	while (1) {
+		k_sem_take(&nus_tx_sem, K_FOREVER);
+
+		/* Serve the links round-robin, one PDU each, so that a
+		 * fast peer cannot starve the others.
+		 */
+		do {
+			pending = false;
+			nomem = false;
+
+			for (i = 0; i < ARRAY_SIZE(nus_ctx); i++) {
+				ctx = &nus_ctx[i];
+
+				if (!nus_ctx_hold(ctx)) {
+					nus_tx_flush_ctx(ctx);
+					continue;
+				}
+
+				ret = nus_tx_drain_ctx(ctx, ctx->conn);
+				nus_ctx_put(ctx);
+
+				if (ret > 0) {
+					pending = true;
+				} else if (ret == -ENOMEM) {
+					/* Out of TX buffers, retry the same bytes */
+					pending = true;
+					nomem = true;
+				}
+				/* On -EBUSY the indication confirmation
+				 * wakes the thread up again
+				 */
+			}
+
+			if (nomem) {
+				k_sleep(K_MSEC(backoff));
+				backoff = min(backoff * 2, CONFIG_NUS_TX_BACKOFF_MAX_MS);
+			} else {
+				backoff = 1;
+			}
+		} while (pending);
+	}
+}
+
+K_THREAD_DEFINE(nus_tx_tid, CONFIG_NUS_TX_THREAD_STACK_SIZE, nus_tx_thread,
+		NULL, NULL, NULL, CONFIG_NUS_TX_THREAD_PRIO, 0, K_NO_WAIT);
+#endif /* CONFIG_NUS_TX_QUEUE */
+
+#if defined(CONFIG_NUS_STATS_SHELL)
+static void nus_hist_print(const char *name, const u32_t *hist)
+{
+	int i;
+
+	printk("  %s:", name);
+
+	for (i = 0; i < NUS_STATS_HIST_BUCKETS; i++) {
+		if (!hist[i]) {
+			continue;
+		}
+
+		if (i == NUS_STATS_HIST_BUCKETS - 1) {
+			printk(" >%uus:%u", nus_stats_bucket_us(i - 1), hist[i]);
+		} else {
+			printk(" <%uus:%u", nus_stats_bucket_us(i), hist[i]);
+		}
+	}
+
+	printk("\n");
+}
+
+static int cmd_nus_stats(int argc, char *argv[])
+{
+	char addr[BT_ADDR_LE_STR_LEN];
+	struct nus_stats stats;
+	struct bt_conn *conn;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(nus_ctx); i++) {
+		if (!nus_ctx_hold(&nus_ctx[i])) {
+			continue;
+		}
+
+		conn = nus_ctx[i].conn;
+		nus_stats_get(conn, &stats);
+		bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+		nus_ctx_put(&nus_ctx[i]);
+
+		printk("%s ready after %u ms, first notification after %d ms\n",
+		       addr, stats.ready_ms, (s32_t)stats.first_tx_ms);
+		printk("  tx %u bytes %u packets, errors %u (nomem %u notconn %u)\n",
+		       stats.tx_bytes, stats.tx_packets, stats.tx_errors,
+		       stats.tx_err_nomem, stats.tx_err_notconn);
+		printk("  rx %u bytes %u packets, rejected %u\n",
+		       stats.rx_bytes, stats.rx_packets, stats.rx_rejected);
+		printk("  ccc on %u off %u, tx queue high-water %u bytes\n",
+		       stats.ccc_enabled, stats.ccc_disabled,
+		       stats.tx_queue_hwm);
+		if (stats.comp_in_bytes) {
+			printk("  compressed %u to %u bytes (%u%%), %u us per KB\n",
+			       stats.comp_in_bytes, stats.comp_out_bytes,
+			       (u32_t)((u64_t)stats.comp_out_bytes * 100 /
+				       stats.comp_in_bytes),
+			       (u32_t)((u64_t)stats.comp_cycles * USEC_PER_SEC /
+				       sys_clock_hw_cycles_per_sec * 1024 /
+				       stats.comp_in_bytes));
+		}
+		nus_hist_print("enqueue to air", stats.enqueue_to_air);
+		nus_hist_print("write to handler", stats.write_to_handler);
+	}
+
+	return 0;
+}
+
+static struct shell_cmd nus_commands[] = {
+	{ "stats", cmd_nus_stats, "Dump the NUS statistics of every link" },
+	{ NULL, NULL, NULL }
+};
+
+SHELL_REGISTER("nus", nus_commands);
+#endif /* CONFIG_NUS_STATS_SHELL */
@@ -13,19 +13,102 @@
 
 #include <bluetooth/conn.h>
 #include <bluetooth/uuid.h>
+#include <net/buf.h>
+
+/** @def BT_UUID_NUS_N
+ *  @brief Nordic UART Service instance n, see CONFIG_NUS_INSTANCES
+ *
+ *  Instance 0 uses the Nordic UUIDs, further instances differ from them
+ *  in the least significant byte.
+ */
+#define BT_UUID_NUS_N(n)       BT_UUID_DECLARE_128(0x9E + (n), 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x01, 0x00, 0x40, 0x6E)
+/** @def BT_UUID_NUS_RX_N
+ *  @brief NUS RX Service of instance n
+ */
+#define BT_UUID_NUS_RX_N(n)    BT_UUID_DECLARE_128(0x9E + (n), 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x02, 0x00, 0x40, 0x6E)
+/** @def BT_UUID_NUS_TX_N
+ *  @brief NUS TX Service of instance n
+ */
+#define BT_UUID_NUS_TX_N(n)    BT_UUID_DECLARE_128(0x9E + (n), 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x03, 0x00, 0x40, 0x6E)
 
 /** @def BT_UUID_NUS
  *  @brief Nordic UART Service
  */
-#define BT_UUID_NUS            BT_UUID_DECLARE_128(0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x01, 0x00, 0x40, 0x6E)
+#define BT_UUID_NUS            BT_UUID_NUS_N(0)
 /** @def BT_UUID_NUS_RX
  *  @brief NUS RX Service
  */
-#define BT_UUID_NUS_RX         BT_UUID_DECLARE_128(0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x02, 0x00, 0x40, 0x6E)
+#define BT_UUID_NUS_RX         BT_UUID_NUS_RX_N(0)
 /** @def BT_UUID_NUS_TX
  *  @brief NUS TX Service
  */
-#define BT_UUID_NUS_TX         BT_UUID_DECLARE_128(0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x03, 0x00, 0x40, 0x6E)
+#define BT_UUID_NUS_TX         BT_UUID_NUS_TX_N(0)
+
+/** @def BT_ATT_DEFAULT_LE_MTU
+ *  @brief ATT MTU used before (or without) an MTU exchange
+ */
+#ifndef BT_ATT_DEFAULT_LE_MTU
+#define BT_ATT_DEFAULT_LE_MTU  23
+#endif
+
+/** @def NUS_RX_MAX_LEN
+ *  @brief Largest RX write accepted, i.e. the local ATT MTU minus the
+ *         3 byte ATT write header
+ */
+#define NUS_RX_MAX_LEN         (CONFIG_BT_L2CAP_RX_MTU - 3)
+
+/** @def NUS_CREDIT_MAGIC
+ *  @brief First two bytes, little endian, of a credit frame
+ */
+#define NUS_CREDIT_MAGIC       0x4e43
+
+/**@brief   Credit frame, notified on TX with CONFIG_NUS_CREDITS.
+ *
+ * @details Grants the central @p credits more Write Commands to RX. With
+ *          credits enabled a 4 byte notification starting with
+ *          @ref NUS_CREDIT_MAGIC is always a credit frame; application data
+ *          of that shape is split one byte earlier.
+ */
+struct nus_credit_frame
+{
+    u16_t magic;   /**< @ref NUS_CREDIT_MAGIC, little endian. */
+    u16_t credits; /**< Credits granted, little endian. */
+} __packed;
+
+/** @def NUS_CAPS_MAGIC
+ *  @brief First two bytes, little endian, of a capability frame
+ */
+#define NUS_CAPS_MAGIC         0x4e4b
+
+/** @def NUS_CAP_COMPRESS
+ *  @brief TX data of instance 0 may be compressed, see CONFIG_NUS_COMPRESS
+ */
+#define NUS_CAP_COMPRESS       BIT(0)
+
+/**@brief   Capability frame.
+ *
+ * @details Written by the central to RX right after subscribing, with the
+ *          capabilities it supports. The peripheral notifies it back on TX
+ *          with those it accepted, which apply to every later notification.
+ *          Neither side sends application data of that shape on instance
+ *          0, it is split one byte earlier.
+ */
+struct nus_caps_frame
+{
+    u16_t magic; /**< @ref NUS_CAPS_MAGIC, little endian. */
+    u8_t  caps;  /**< NUS_CAP_* bits. */
+} __packed;
+
+/** @def NUS_COMP_HDR_RAW
+ *  @brief With @ref NUS_CAP_COMPRESS accepted, first byte of a notification
+ *         carrying plain data
+ */
+#define NUS_COMP_HDR_RAW       0x00
+/** @def NUS_COMP_HDR_LZ
+ *  @brief With @ref NUS_CAP_COMPRESS accepted, first byte of a notification
+ *         carrying a compressed block, see nus_comp.h
+ */
+#define NUS_COMP_HDR_LZ        0x01
 
 /**@brief   Nordic UART Service @ref BLE_NUS_EVT_RX_DATA event data.
  *
@@ -33,8 +116,19 @@
  */
 typedef struct
 {
-    uint8_t const * p_data; /**< A pointer to the buffer with received data. */
+    uint8_t const * p_data; /**< A pointer to the buffer with received data. With
+                                 CONFIG_NUS_RX_ZERO_COPY this points into the ATT
+                                 PDU and is only valid during the callback. */
     uint16_t        length; /**< Length of received data. */
+    struct net_buf *buf;    /**< With CONFIG_NUS_BUF_POOL and without
+                                 CONFIG_NUS_RX_ZERO_COPY the pool buffer
+                                 holding exactly the received data, NULL
+                                 otherwise. Take a reference with
+                                 net_buf_ref() to keep it past the callback.
+                                 With CONFIG_NUS_RX_READ NUS keeps it for
+                                 reading RX back, so leave it unmodified. */
+    u8_t            chan;   /**< NUS instance written to, see
+                                 CONFIG_NUS_INSTANCES. */
 } ble_nus_evt_rx_data_t;
 
 
@@ -52,6 +146,76 @@ typedef struct
 /**@brief Nordic UART Service event handler type. */
 typedef void (* ble_nus_data_handler_t) (ble_nus_data_evt_t * p_evt);
 
+/**@brief Nordic UART Service payload size handler type.
+ *
+ * @details Called with the usable notification payload once the ATT MTU has
+ *          been negotiated, and again after a security upgrade.
+ */
+typedef void (* ble_nus_payload_len_handler_t) (struct bt_conn *conn, u16_t payload_len);
+
+/**@brief   NUS link profiles.
+ *
+ * @details A profile is requested once the link reaches the NUS security
+ *          level, or right after connecting when no pairing is required.
+ */
+typedef enum
+{
+    NUS_LINK_PROFILE_NONE,      /**< Keep the parameters the central picked. */
+    NUS_LINK_PROFILE_BULK,      /**< 7.5-15 ms interval, no latency, 2M PHY. */
+    NUS_LINK_PROFILE_LOW_POWER, /**< 400-500 ms interval, latency 4, 1M PHY. */
+} nus_link_profile_t;
+
+/**@brief Nordic UART Service link parameter handler type.
+ *
+ * @details Called with the connection parameters actually granted, in units
+ *          of 1.25 ms for @p interval and 10 ms for @p timeout.
+ */
+typedef void (* ble_nus_link_handler_t) (struct bt_conn *conn, u16_t interval,
+                                         u16_t latency, u16_t timeout);
+
+
+/**@brief Nordic UART Service ready handler type.
+ *
+ * @details Called when a link is both subscribed and secured, i.e. NUS data
+ *          starts to flow, with the time it took since the connection.
+ */
+typedef void (* ble_nus_ready_handler_t) (struct bt_conn *conn, u32_t connect_to_ready_ms);
+
+/** @def NUS_STATS_HIST_BUCKETS
+ *  @brief Number of buckets of the NUS latency histograms
+ *
+ *  Bucket 0 counts samples below 1 cycle of the hardware clock, bucket i
+ *  samples of [2^(i-1), 2^i) cycles; the last one also counts everything
+ *  longer. Use @ref nus_stats_bucket_us to convert a bound to microseconds.
+ */
+#define NUS_STATS_HIST_BUCKETS 24
+
+/**@brief   Per connection NUS statistics. */
+struct nus_stats
+{
+    u32_t tx_bytes;        /**< Payload bytes notified. */
+    u32_t tx_packets;      /**< Notifications sent. */
+    u32_t tx_errors;       /**< Failed notification attempts. */
+    u32_t tx_err_nomem;    /**< Of which out of TX buffers (-ENOMEM). */
+    u32_t tx_err_notconn;  /**< Of which link gone (-ENOTCONN). */
+    u32_t rx_bytes;        /**< Payload bytes written to RX. */
+    u32_t rx_packets;      /**< Writes to RX. */
+    u32_t rx_rejected;     /**< RX writes refused for lack of security. */
+    u32_t ccc_enabled;     /**< Notifications turned on by the peer. */
+    u32_t ccc_disabled;    /**< Notifications turned off by the peer. */
+    u32_t tx_queue_hwm;    /**< Most bytes ever waiting in the TX ring. */
+    u32_t comp_in_bytes;   /**< TX ring bytes fed to the compressor. */
+    u32_t comp_out_bytes;  /**< Compressed bytes notified for them. */
+    u32_t comp_cycles;     /**< Hardware cycles spent compressing. */
+    u32_t ready_ms;        /**< Time from connection to subscribed and secured. */
+    u32_t first_tx_ms;     /**< Time from ready to the first notification
+                                handed to the host, UINT32_MAX before. */
+    /** Time from @ref nus_tx_enqueue to the bytes being handed to the
+     *  host, sampled one enqueue at a time. */
+    u32_t enqueue_to_air[NUS_STATS_HIST_BUCKETS];
+    /** Time spent in the data handler for each RX write. */
+    u32_t write_to_handler[NUS_STATS_HIST_BUCKETS];
+};
 
 /**@brief   Nordic UART Service initialization structure.
  *
@@ -62,6 +226,10 @@ typedef void (* ble_nus_data_handler_t) (ble_nus_data_evt_t * p_evt);
 typedef struct
 {
     ble_nus_data_handler_t data_handler; /**< Event handler to be called for handling received data. */
+    ble_nus_payload_len_handler_t payload_len_handler; /**< Optional, called when the payload size changes. */
+    nus_link_profile_t     link_profile; /**< Link profile requested for new connections. */
+    ble_nus_link_handler_t link_handler; /**< Optional, called when the link parameters change. */
+    ble_nus_ready_handler_t ready_handler; /**< Optional, called when a link becomes ready. */
 } ble_nus_init_t;
 
  
@@ -70,8 +238,184 @@ extern "C" {
 #endif
 
 s32_t nus_init(ble_nus_init_t *p_init);
+
+/**@brief   Select the link profile of a connection.
+ *
+ * @details The profile also becomes the default for later connections. It is
+ *          requested immediately if @p conn is already secured, otherwise
+ *          once security completes. @p conn may be NULL to only change the
+ *          default.
+ */
+s32_t nus_link_profile_set(struct bt_conn *conn, nus_link_profile_t profile);
+
+/**@brief   Set the security level NUS requires.
+ *
+ * @details Defaults to CONFIG_NUS_SECURITY_LEVEL. NUS requests this level on
+ *          every new link, and refuses RX writes and holds back TX data until
+ *          a link reaches it. Links that are already up are asked to raise
+ *          their security.
+ */
+s32_t nus_security_set(bt_security_t level);
+
+/**@brief   Get the security level NUS requires. */
+bt_security_t nus_security_get(void);
+
+/**@brief   Get the notification payload size of a connection.
+ *
+ * @details Returns the negotiated ATT MTU minus the 3 byte notification
+ *          header, or the default LE payload if @p conn is NULL.
+ */
+u16_t nus_get_payload_len(struct bt_conn *conn);
+
+/**@brief   Send a buffer over the NUS TX characteristic.
+ *
+ * @details The buffer is split into as many notifications as needed, each
+ *          filled up to @ref nus_get_payload_len bytes. If @p conn is NULL
+ *          the buffer is sent to every subscribed and secured peer. A peer
+ *          subscribed with indications takes one packet per confirmation,
+ *          the TX queue pipelines them instead. On instance 0 a notification
+ *          that would look like a control frame, see @ref nus_credit_frame
+ *          and @ref nus_caps_frame, is split one byte earlier.
+ *
+ * @return  Number of bytes queued for transmission, or a negative error if
+ *          nothing could be sent: -ENOTCONN if no peer is subscribed and
+ *          secured, -ENOMEM out of host buffers, or -EAGAIN while
+ *          CONFIG_NUS_COMPRESS switches the framing of instance 0, in
+ *          which case the send can be retried shortly. When fanning out,
+ *          the smallest result over all peers.
+ */
+s32_t nus_send(struct bt_conn *conn, const void *data, u16_t len);
+
+/**@brief   Send a buffer over the TX characteristic of a NUS instance.
+ *
+ * @details Same as @ref nus_send, for instance @p chan of
+ *          CONFIG_NUS_INSTANCES; peers must be subscribed to that instance.
+ *          @ref nus_send and the TX queue use instance 0.
+ *
+ * @return  As @ref nus_send, or -EINVAL if @p chan does not exist.
+ */
+s32_t nus_chan_send(struct bt_conn *conn, u8_t chan, const void *data,
+                    u16_t len);
+
+/**@brief   Send a single byte, kept for compatibility with @ref nus_send. */
 s32_t nus_notify(struct bt_conn *conn, u8_t tx);
 
+/**@brief   Get the number of links that are subscribed and secured. */
+u8_t nus_ready_count(void);
+
+/**@brief   Get a snapshot of the statistics of a connection.
+ *
+ * @details Counters are only kept with CONFIG_NUS_STATS, otherwise only
+ *          ready_ms and first_tx_ms are filled in.
+ */
+s32_t nus_stats_get(struct bt_conn *conn, struct nus_stats *stats);
+
+/**@brief   Get the upper bound of a latency histogram bucket in microseconds. */
+u32_t nus_stats_bucket_us(u8_t bucket);
+
+#if defined(CONFIG_NUS_TX_QUEUE)
+/**@brief   Queue bytes for asynchronous transmission.
+ *
+ * @details Copies the data into the TX ring of @p conn, or of every
+ *          subscribed and secured peer if @p conn is NULL, and wakes the drain thread,
+ *          which coalesces queued bytes into MTU-sized notifications. Safe to
+ *          call from any context including ISRs, but there must be a single
+ *          producer per ring at a time.
+ *
+ * @return  Number of bytes queued, less than @p len if a ring is full.
+ */
+u16_t nus_tx_enqueue(struct bt_conn *conn, const void *data, u16_t len);
+
+/**@brief   Get the number of free bytes in the TX ring of a connection. */
+u16_t nus_tx_space(struct bt_conn *conn);
+
+/**@brief   Get the data the TX queue puts into each notification of a
+ *          connection.
+ *
+ * @details @ref nus_get_payload_len less the header of CONFIG_NUS_COMPRESS
+ *          once the peer uses compression. A pool buffer of up to this
+ *          length is sent as a single notification.
+ *
+ * @return  The length, or 0 if @p conn is not a NUS link.
+ */
+u16_t nus_tx_data_len(struct bt_conn *conn);
+
+/**@brief   Data of one or more notifications for @ref nus_send_batch. */
+struct nus_iovec
+{
+    const void *iov_base; /**< Data, left untouched until the batch completes. */
+    u16_t       iov_len;  /**< Length, split into several notifications if
+                               above @ref nus_get_payload_len. */
+};
+
+/**@brief   NUS batch completion callback type.
+ *
+ * @details Called from the TX drain thread with 0 once every notification of
+ *          the batch has been handed to the host, or with the error that
+ *          ended it early. For a peer that subscribed with indications
+ *          (CONFIG_NUS_TX_INDICATE) it waits until the peer confirmed all
+ *          of them. Another batch may be queued from the callback.
+ */
+typedef void (* nus_batch_cb_t) (struct bt_conn *conn, s32_t err, void *user_data);
+
+/**@brief   Send a batch of notifications back to back.
+ *
+ * @details The TX drain thread passes the notifications to the host without
+ *          waiting in between, so that the controller can put several of
+ *          them into the same connection event, and reports a single
+ *          completion through @p cb. The host does not report link layer
+ *          acknowledgements of notifications, so completion means that all
+ *          of them are queued for transmission, unless the peer takes
+ *          indications. One batch per link can be pending.
+ *
+ * @return  0 if the batch was queued, -EBUSY if one is pending already,
+ *          -ENOTCONN if @p conn is not a NUS link.
+ */
+s32_t nus_send_batch(struct bt_conn *conn, const struct nus_iovec *vec,
+                     size_t cnt, nus_batch_cb_t cb, void *user_data);
+#endif
+
+#if defined(CONFIG_NUS_BUF_POOL)
+/**@brief   Allocate a buffer from the NUS pool.
+ *
+ * @details Buffers hold up to CONFIG_NUS_BUF_SIZE bytes. With K_NO_WAIT
+ *          this is safe to call from ISRs.
+ *
+ * @return  The buffer, or NULL if the pool is exhausted within @p timeout.
+ */
+struct net_buf *nus_buf_alloc(s32_t timeout);
+
+/**@brief   Queue a pool buffer for asynchronous transmission.
+ *
+ * @details Queues a reference to @p buf for @p conn, or for every subscribed
+ *          and secured peer if @p conn is NULL, without copying the data.
+ *          The caller keeps its own reference. The drain thread splits the
+ *          buffer into notifications and releases the reference once all of
+ *          it has been sent. Buffers are sent after the bytes already in the
+ *          TX ring of a link but are not ordered against later
+ *          @ref nus_tx_enqueue calls. There must be a single producer at a
+ *          time.
+ *
+ * @return  0 on success, -ENOMEM if a queue is full, in which case nothing
+ *          was queued, or -ENOTCONN if there is no peer to send to.
+ */
+s32_t nus_tx_enqueue_buf(struct bt_conn *conn, struct net_buf *buf);
+
+/**@brief   Queue a pool buffer that must go out as a single notification.
+ *
+ * @details As @ref nus_tx_enqueue_buf, for data framed per notification
+ *          such as the fragments of nus_frame.h. If the buffer no longer
+ *          fits into a notification once it is up, for instance because
+ *          the peer switched on compression meanwhile, it is dropped and
+ *          counted as a TX error rather than split.
+ *
+ * @return  As @ref nus_tx_enqueue_buf, or -EINVAL if the buffer looks like
+ *          a control frame, see @ref nus_credit_frame and
+ *          @ref nus_caps_frame.
+ */
+s32_t nus_tx_enqueue_pdu(struct bt_conn *conn, struct net_buf *buf);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,87 @@
+/** @file
+ *  @brief Nordic NUS benchmark helpers
+ *
+ *  Clock, frame and histogram helpers shared by the benchmark modes of the
+ *  peripheral and central NUS samples.
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <misc/byteorder.h>
+#include <zephyr.h>
+
+#include "nus_bench.h"
+
+u32_t nus_bench_time_us(void)
+{
+	static u32_t last_cycles;
+	static u64_t cycles;
+	unsigned int key;
+	u32_t now;
+	u64_t total;
+
+	key = irq_lock();
+	now = k_cycle_get_32();
+	cycles += now - last_cycles;
+	last_cycles = now;
+	total = cycles;
+	irq_unlock(key);
+
+	return (u32_t)(total * USEC_PER_SEC / sys_clock_hw_cycles_per_sec);
+}
+
+void nus_bench_hdr_init(struct nus_bench_hdr *hdr, u8_t type, u16_t seq)
+{
+	hdr->magic = NUS_BENCH_MAGIC;
+	hdr->type = type;
+	hdr->seq = sys_cpu_to_le16(seq);
+	hdr->time_us = sys_cpu_to_le32(nus_bench_time_us());
+}
+
+u8_t nus_bench_type(const void *data, u16_t len)
+{
+	const struct nus_bench_hdr *hdr = data;
+
+	if (len < sizeof(*hdr) || hdr->magic != NUS_BENCH_MAGIC) {
+		return 0;
+	}
+
+	return hdr->type;
+}
+
+void nus_bench_hist_add(struct nus_bench_hist *hist, s32_t us)
+{
+	u32_t idx = us > 0 ? us / NUS_BENCH_HIST_STEP_US : 0;
+
+	hist->bucket[min(idx, NUS_BENCH_HIST_BUCKETS - 1)]++;
+	hist->count++;
+}
+
+u32_t nus_bench_hist_pct(const struct nus_bench_hist *hist, u8_t pct)
+{
+	u32_t rank, seen = 0;
+	int i;
+
+	if (!hist->count) {
+		return 0;
+	}
+
+	/* Smallest bucket covering pct percent of the samples */
+	rank = ((u64_t)hist->count * pct + 99) / 100;
+
+	for (i = 0; i < NUS_BENCH_HIST_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= rank) {
+			break;
+		}
+	}
+
+	return (min(i, NUS_BENCH_HIST_BUCKETS - 1) + 1) * NUS_BENCH_HIST_STEP_US;
+}
@@ -0,0 +1,122 @@
+/** @file
+ *  @brief Nordic NUS benchmark protocol
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __NUS_BENCH_H
+#define __NUS_BENCH_H
+
+#include <zephyr/types.h>
+#include <toolchain.h>
+
+/** @def NUS_BENCH_MAGIC
+ *  @brief First byte of every benchmark frame, anything else is plain NUS data
+ */
+#define NUS_BENCH_MAGIC        0xB5
+
+/** @def NUS_BENCH_HIST_BUCKETS
+ *  @brief Number of latency histogram buckets
+ */
+#define NUS_BENCH_HIST_BUCKETS 512
+
+/** @def NUS_BENCH_HIST_STEP_US
+ *  @brief Width of a latency histogram bucket; the last bucket takes
+ *         everything above NUS_BENCH_HIST_BUCKETS * NUS_BENCH_HIST_STEP_US
+ */
+#define NUS_BENCH_HIST_STEP_US 250
+
+/**@brief   Benchmark frame types.
+ *
+ * @details START, STOP and PING are written by the central to NUS RX, the
+ *          others are notified by the peripheral on NUS TX.
+ */
+enum
+{
+    NUS_BENCH_START = 1, /**< Start streaming, see @ref nus_bench_start. */
+    NUS_BENCH_STOP,      /**< Stop streaming early. */
+    NUS_BENCH_PING,      /**< Round trip probe, answered with a PONG. */
+    NUS_BENCH_PONG,      /**< See @ref nus_bench_pong. */
+    NUS_BENCH_DATA,      /**< Stream frame, padded to the payload size. */
+    NUS_BENCH_DONE,      /**< End of stream, see @ref nus_bench_done. */
+};
+
+/**@brief   Header shared by all benchmark frames, little endian. */
+struct nus_bench_hdr
+{
+    u8_t  magic;   /**< @ref NUS_BENCH_MAGIC. */
+    u8_t  type;    /**< Frame type. */
+    u16_t seq;     /**< Sequence number, per frame type. */
+    u32_t time_us; /**< Sender clock when the frame was handed to the host. */
+} __packed;
+
+/**@brief   START frame. */
+struct nus_bench_start
+{
+    struct nus_bench_hdr hdr;
+    u16_t payload_len;   /**< Requested DATA frame size, capped to the MTU. */
+    u16_t reserved;
+    u32_t duration_ms;   /**< How long to stream. */
+} __packed;
+
+/**@brief   PONG frame, hdr.time_us is the peripheral clock when sent. */
+struct nus_bench_pong
+{
+    struct nus_bench_hdr hdr;
+    u32_t ping_time_us;  /**< time_us of the PING, central clock. */
+    u32_t rx_time_us;    /**< When the PING arrived, peripheral clock. */
+} __packed;
+
+/**@brief   DONE frame. */
+struct nus_bench_done
+{
+    struct nus_bench_hdr hdr;
+    u32_t frames;        /**< DATA frames sent. */
+    u32_t bytes;         /**< DATA bytes sent. */
+} __packed;
+
+/**@brief   Latency histogram. */
+struct nus_bench_hist
+{
+    u32_t count;
+    u32_t bucket[NUS_BENCH_HIST_BUCKETS];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@brief   Get a free running microsecond clock.
+ *
+ * @details Based on the hardware cycle counter, extended to 64 bits so that
+ *          it stays monotonic across counter wraps as long as it is called at
+ *          least once per wrap.
+ */
+u32_t nus_bench_time_us(void);
+
+/**@brief   Fill in a frame header. */
+void nus_bench_hdr_init(struct nus_bench_hdr *hdr, u8_t type, u16_t seq);
+
+/**@brief   Check that a buffer holds a benchmark frame of at least @p len bytes.
+ *
+ * @return  The frame type, or 0 if it is not a benchmark frame.
+ */
+u8_t nus_bench_type(const void *data, u16_t len);
+
+/**@brief   Add a sample to a histogram, negative values count as 0. */
+void nus_bench_hist_add(struct nus_bench_hist *hist, s32_t us);
+
+/**@brief   Get a percentile of a histogram, as the upper bound of its bucket.
+ *
+ * @return  The percentile in microseconds, 0 if the histogram is empty.
+ */
+u32_t nus_bench_hist_pct(const struct nus_bench_hist *hist, u8_t pct);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NUS_BENCH_H */
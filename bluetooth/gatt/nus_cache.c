@@ -0,0 +1,191 @@
+/** @file
+ *  @brief Nordic NUS handle cache
+ *
+ *  Keeps the NUS handles discovered on bonded peers in a small LRU table so
+ *  that reconnecting centrals can subscribe without service discovery. With
+ *  CONFIG_NUS_CLIENT_HANDLE_CACHE_SETTINGS the table is persisted through
+ *  the settings subsystem under "nus/<slot>".
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <misc/printk.h>
+#include <zephyr.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+
+#if defined(CONFIG_NUS_CLIENT_HANDLE_CACHE_SETTINGS)
+#include <settings/settings.h>
+#endif
+
+#include "nus_cache.h"
+
+struct nus_cache_entry {
+	bt_addr_le_t addr;
+	struct nus_handles handles;
+	/* Last use, larger is more recent; 0 marks a free entry */
+	u32_t stamp;
+};
+
+static struct nus_cache_entry nus_cache[CONFIG_NUS_CLIENT_HANDLE_CACHE_SIZE];
+static u32_t nus_cache_clock;
+
+static struct nus_cache_entry *nus_cache_find(const bt_addr_le_t *peer)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(nus_cache); i++) {
+		if (nus_cache[i].stamp &&
+		    !bt_addr_le_cmp(&nus_cache[i].addr, peer)) {
+			return &nus_cache[i];
+		}
+	}
+
+	return NULL;
+}
+
+#if defined(CONFIG_NUS_CLIENT_HANDLE_CACHE_SETTINGS)
+static void nus_cache_save(struct nus_cache_entry *entry)
+{
+	char key[16];
+	char val[SETTINGS_MAX_VAL_LEN];
+	char *str = NULL;
+	int err;
+
+	snprintk(key, sizeof(key), "nus/%u", entry - nus_cache);
+
+	if (entry->stamp) {
+		str = settings_str_from_bytes(entry, sizeof(*entry), val,
+					      sizeof(val));
+		if (!str) {
+			printk("NUS cache entry too large to save\n");
+			return;
+		}
+	}
+
+	err = settings_save_one(key, str);
+	if (err) {
+		printk("NUS cache save failed (err %d)\n", err);
+	}
+}
+
+static int nus_cache_set(int argc, char **argv, char *val)
+{
+	struct nus_cache_entry entry;
+	int len = sizeof(entry);
+	long slot;
+
+	if (argc != 1) {
+		return -ENOENT;
+	}
+
+	slot = strtol(argv[0], NULL, 10);
+	if (slot < 0 || slot >= ARRAY_SIZE(nus_cache)) {
+		/* Left over from a larger cache, ignore */
+		return 0;
+	}
+
+	if (!val) {
+		memset(&nus_cache[slot], 0, sizeof(nus_cache[slot]));
+		return 0;
+	}
+
+	if (settings_bytes_from_str(val, &entry, &len) || len != sizeof(entry)) {
+		return -EINVAL;
+	}
+
+	nus_cache[slot] = entry;
+	nus_cache_clock = max(nus_cache_clock, entry.stamp);
+
+	return 0;
+}
+
+static struct settings_handler nus_cache_settings = {
+	.name = "nus",
+	.h_set = nus_cache_set,
+};
+#else
+static inline void nus_cache_save(struct nus_cache_entry *entry)
+{
+}
+#endif /* CONFIG_NUS_CLIENT_HANDLE_CACHE_SETTINGS */
+
+s32_t nus_cache_init(void)
+{
+#if defined(CONFIG_NUS_CLIENT_HANDLE_CACHE_SETTINGS)
+	int err;
+
+	err = settings_subsys_init();
+	if (err) {
+		return err;
+	}
+
+	return settings_register(&nus_cache_settings);
+#else
+	return 0;
+#endif
+}
+
+s32_t nus_cache_get(const bt_addr_le_t *peer, struct nus_handles *handles)
+{
+	struct nus_cache_entry *entry = nus_cache_find(peer);
+
+	if (!entry) {
+		return -ENOENT;
+	}
+
+	/* Only the RAM copy is touched, the order is rebuilt on store */
+	entry->stamp = ++nus_cache_clock;
+	*handles = entry->handles;
+
+	return 0;
+}
+
+void nus_cache_store(const bt_addr_le_t *peer, const struct nus_handles *handles)
+{
+	struct nus_cache_entry *entry;
+	int i;
+
+	if (!bt_addr_le_is_bonded(peer)) {
+		return;
+	}
+
+	entry = nus_cache_find(peer);
+	if (!entry) {
+		/* Take a free entry, or the least recently used one */
+		entry = &nus_cache[0];
+		for (i = 1; i < ARRAY_SIZE(nus_cache) && entry->stamp; i++) {
+			if (nus_cache[i].stamp < entry->stamp) {
+				entry = &nus_cache[i];
+			}
+		}
+	}
+
+	bt_addr_le_copy(&entry->addr, peer);
+	entry->handles = *handles;
+	entry->stamp = ++nus_cache_clock;
+
+	nus_cache_save(entry);
+}
+
+void nus_cache_remove(const bt_addr_le_t *peer)
+{
+	struct nus_cache_entry *entry = nus_cache_find(peer);
+
+	if (!entry) {
+		return;
+	}
+
+	memset(entry, 0, sizeof(*entry));
+	nus_cache_save(entry);
+}
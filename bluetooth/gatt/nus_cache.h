@@ -0,0 +1,55 @@
+/** @file
+ *  @brief Nordic NUS handle cache
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __NUS_CACHE_H
+#define __NUS_CACHE_H
+
+#include <bluetooth/bluetooth.h>
+
+/**@brief   NUS attribute handles of a peer. */
+struct nus_handles
+{
+    u16_t rx;  /**< RX characteristic value handle. */
+    u16_t tx;  /**< TX characteristic value handle. */
+    u16_t ccc; /**< TX CCC descriptor handle. */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@brief   Initialize the cache and register its settings handler.
+ *
+ * @details Must be called before settings_load() for the persisted entries
+ *          to be restored.
+ */
+s32_t nus_cache_init(void);
+
+/**@brief   Look up the handles of a peer identity.
+ *
+ * @return  0 on a hit, -ENOENT otherwise.
+ */
+s32_t nus_cache_get(const bt_addr_le_t *peer, struct nus_handles *handles);
+
+/**@brief   Remember the handles of a bonded peer.
+ *
+ * @details Unbonded peers are ignored since their address may not survive
+ *          the connection. The least recently used entry is replaced when
+ *          the cache is full.
+ */
+void nus_cache_store(const bt_addr_le_t *peer, const struct nus_handles *handles);
+
+/**@brief   Forget the handles of a peer, e.g. after they turned out stale. */
+void nus_cache_remove(const bt_addr_le_t *peer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NUS_CACHE_H */
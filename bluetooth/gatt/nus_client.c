@@ -0,0 +1,798 @@
+/** @file
+ *  @brief Nordic NUS client
+ *
+ *  Central side of NUS. Every link walks a small state machine: the
+ *  service is looked up first, then all of its characteristics in a single
+ *  sweep and finally the CCC of TX, after which the link is subscribed. The
+ *  handles of bonded peers are cached, so a reconnect subscribes right away
+ *  and validates the cached TX declaration in parallel.
+ *
+ *  Data is pipelined as Write Commands, and with CONFIG_NUS_CREDITS every
+ *  one of them spends a credit that the peripheral hands back in a credit
+ *  frame on TX once the data has been consumed, so that a slow peripheral
+ *  throttles the central instead of losing writes.
+ *
+ *  With CONFIG_NUS_COMPRESS the client offers compression in a capability
+ *  frame as soon as a link is subscribed, and decodes TX once the
+ *  peripheral accepted it.
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <misc/printk.h>
+#include <misc/byteorder.h>
+#include <zephyr.h>
+#include <atomic.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/gatt.h>
+#include <bluetooth/uuid.h>
+
+#include "nus.h"
+#include "nus_cache.h"
+#include "nus_client.h"
+#include "nus_log.h"
+#if defined(CONFIG_NUS_COMPRESS)
+#include "nus_comp.h"
+#endif
+
+enum {
+	NUS_CLIENT_IDLE,
+	NUS_CLIENT_DISC_SVC,
+	NUS_CLIENT_DISC_CHRC,
+	NUS_CLIENT_DISC_CCC,
+	/* Subscribed to cached handles, TX declaration being read back */
+	NUS_CLIENT_VALIDATING,
+	NUS_CLIENT_READY,
+};
+
+enum {
+	NUS_CLIENT_MTU_IDLE,
+	NUS_CLIENT_MTU_PENDING,
+	NUS_CLIENT_MTU_DONE,
+};
+
+#if defined(CONFIG_NUS_COMPRESS)
+enum {
+	NUS_CLIENT_COMP_OFF,
+	/* Capability frame sent, TX is plain until the answer */
+	NUS_CLIENT_COMP_REQUESTED,
+	/* TX data carries a NUS_COMP_HDR_* byte */
+	NUS_CLIENT_COMP_ON,
+};
+#endif
+
+/* A slot is in use while conn is set, from the connection on */
+struct nus_client_ctx {
+	struct bt_conn *conn;
+	u8_t state;
+	/* Passed to nus_client_start(), reported on disconnect */
+	bool started;
+	u8_t mtu_state;
+	struct bt_gatt_exchange_params mtu_params;
+	struct nus_handles handles;
+	/* Last handle of the service, and of the TX characteristic */
+	u16_t end_handle;
+	u16_t tx_end_handle;
+	struct bt_uuid_128 uuid;
+	struct bt_uuid_16 ccc_uuid;
+	struct bt_gatt_discover_params discover_params;
+	struct bt_gatt_subscribe_params subscribe_params;
+#if defined(CONFIG_NUS_CLIENT_HANDLE_CACHE)
+	struct bt_gatt_read_params read_params;
+#endif
+	atomic_t credits;
+#if defined(CONFIG_NUS_COMPRESS)
+	u8_t comp_state;
+	struct nus_comp_dec comp_dec;
+	struct nus_client_comp_stats comp_stats;
+#endif
+};
+
+static struct nus_client_ctx nus_clients[CONFIG_BT_MAX_CONN];
+static const struct nus_client_cb *nus_client_cb;
+
+static struct nus_client_ctx *nus_client_get(struct bt_conn *conn)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(nus_clients); i++) {
+		if (conn && nus_clients[i].conn == conn) {
+			return &nus_clients[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct nus_client_ctx *nus_client_alloc(struct bt_conn *conn)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(nus_clients); i++) {
+		if (!nus_clients[i].conn) {
+			memset(&nus_clients[i], 0, sizeof(nus_clients[i]));
+			nus_clients[i].conn = bt_conn_ref(conn);
+			return &nus_clients[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void nus_client_mtu_exchange_func(struct bt_conn *conn, u8_t err,
+					 struct bt_gatt_exchange_params *params)
+{
+	struct nus_client_ctx *ctx = CONTAINER_OF(params, struct nus_client_ctx,
+						  mtu_params);
+
+	if (err) {
+		printk("NUS MTU exchange failed (err %u)\n", err);
+		ctx->mtu_state = NUS_CLIENT_MTU_IDLE;
+		return;
+	}
+
+	ctx->mtu_state = NUS_CLIENT_MTU_DONE;
+
+	if (nus_client_cb && nus_client_cb->payload_len) {
+		nus_client_cb->payload_len(conn, nus_client_payload_len(conn));
+	}
+}
+
+/* Raise the ATT MTU, it does not need encryption */
+static void nus_client_mtu_exchange(struct nus_client_ctx *ctx)
+{
+	int err;
+
+	if (ctx->mtu_state != NUS_CLIENT_MTU_IDLE) {
+		return;
+	}
+
+	ctx->mtu_params.func = nus_client_mtu_exchange_func;
+
+	err = bt_gatt_exchange_mtu(ctx->conn, &ctx->mtu_params);
+	if (err) {
+		printk("NUS MTU exchange failed (err %d)\n", err);
+		return;
+	}
+
+	ctx->mtu_state = NUS_CLIENT_MTU_PENDING;
+}
+
+#if defined(CONFIG_NUS_CREDITS)
+static bool nus_client_credit_take(struct nus_client_ctx *ctx)
+{
+	atomic_val_t credits;
+
+	do {
+		credits = atomic_get(&ctx->credits);
+		if (!credits) {
+			return false;
+		}
+	} while (!atomic_cas(&ctx->credits, credits, credits - 1));
+
+	return true;
+}
+
+static bool nus_client_credit_frame(struct nus_client_ctx *ctx,
+				    const void *data, u16_t len)
+{
+	const struct nus_credit_frame *frame = data;
+
+	if (len != sizeof(*frame) ||
+	    sys_le16_to_cpu(frame->magic) != NUS_CREDIT_MAGIC) {
+		return false;
+	}
+
+	atomic_add(&ctx->credits, sys_le16_to_cpu(frame->credits));
+
+	return true;
+}
+#endif
+
+#if defined(CONFIG_NUS_COMPRESS)
+/* Offer compression; the answer comes on TX, ahead of compressed data */
+static void nus_client_caps_send(struct nus_client_ctx *ctx)
+{
+	struct nus_caps_frame frame;
+	int err;
+
+	if (ctx->comp_state != NUS_CLIENT_COMP_OFF) {
+		return;
+	}
+
+	frame.magic = sys_cpu_to_le16(NUS_CAPS_MAGIC);
+	frame.caps = NUS_CAP_COMPRESS;
+
+	/* Takes no credit, the peripheral does not return one for it */
+	err = bt_gatt_write_without_response(ctx->conn, ctx->handles.rx,
+					     &frame, sizeof(frame), false);
+	if (err) {
+		printk("NUS capabilities not sent (err %d)\n", err);
+		return;
+	}
+
+	ctx->comp_state = NUS_CLIENT_COMP_REQUESTED;
+}
+
+static void nus_client_comp_sink(void *user_data, const u8_t *data,
+				 u16_t len)
+{
+	struct nus_client_ctx *ctx = user_data;
+
+	ctx->comp_stats.out_bytes += len;
+
+	if (nus_client_cb && nus_client_cb->data) {
+		nus_client_cb->data(ctx->conn, data, len);
+	}
+}
+
+/* Handle TX data of a link that negotiates or uses compression. Returns
+ * false for plain data to pass on as is.
+ */
+static bool nus_client_comp_rx(struct nus_client_ctx *ctx, const u8_t *data,
+			       u16_t len)
+{
+	const struct nus_caps_frame *frame = (const void *)data;
+	u32_t start;
+	s32_t ret;
+
+	switch (ctx->comp_state) {
+	case NUS_CLIENT_COMP_REQUESTED:
+		if (len != sizeof(*frame) ||
+		    sys_le16_to_cpu(frame->magic) != NUS_CAPS_MAGIC) {
+			return false;
+		}
+
+		nus_comp_dec_init(&ctx->comp_dec);
+		ctx->comp_state = (frame->caps & NUS_CAP_COMPRESS) ?
+				  NUS_CLIENT_COMP_ON : NUS_CLIENT_COMP_OFF;
+		NUS_LOG(DATA, INF, "capabilities 0x%02x accepted", frame->caps);
+		return true;
+	case NUS_CLIENT_COMP_ON:
+		break;
+	default:
+		return false;
+	}
+
+	if (!len) {
+		return true;
+	}
+
+	if (data[0] == NUS_COMP_HDR_RAW) {
+		if (nus_client_cb && nus_client_cb->data) {
+			nus_client_cb->data(ctx->conn, data + 1, len - 1);
+		}
+
+		return true;
+	}
+
+	start = k_cycle_get_32();
+	ret = -EINVAL;
+
+	if (data[0] == NUS_COMP_HDR_LZ) {
+		ctx->comp_stats.in_bytes += len;
+		ret = nus_comp_decode(&ctx->comp_dec, data + 1, len - 1,
+				      nus_client_comp_sink, ctx);
+		ctx->comp_stats.cycles += k_cycle_get_32() - start;
+	}
+
+	/* Every later block builds on this one, the stream is lost */
+	if (ret < 0) {
+		printk("NUS compressed stream corrupt, disconnecting\n");
+		ctx->comp_state = NUS_CLIENT_COMP_OFF;
+		bt_conn_disconnect(ctx->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	}
+
+	return true;
+}
+#endif
+
+static void nus_client_ready(struct nus_client_ctx *ctx, bool cached)
+{
+	ctx->state = NUS_CLIENT_READY;
+
+#if defined(CONFIG_NUS_COMPRESS)
+	nus_client_caps_send(ctx);
+#endif
+
+	if (nus_client_cb && nus_client_cb->ready) {
+		nus_client_cb->ready(ctx->conn, cached);
+	}
+}
+
+/* Give up on a link, nus_client_start() may be called again */
+static void nus_client_fail(struct nus_client_ctx *ctx, const char *what,
+			    int err)
+{
+	printk("NUS %s failed (err %d)\n", what, err);
+
+	ctx->state = NUS_CLIENT_IDLE;
+}
+
+static u8_t nus_client_notify_func(struct bt_conn *conn,
+				   struct bt_gatt_subscribe_params *params,
+				   const void *data, u16_t length);
+
+static int nus_client_subscribe(struct nus_client_ctx *ctx)
+{
+	int err;
+
+	ctx->subscribe_params.notify = nus_client_notify_func;
+#if defined(CONFIG_NUS_CLIENT_INDICATE)
+	/* The host confirms each one once the notify func returned */
+	ctx->subscribe_params.value = BT_GATT_CCC_INDICATE;
+#else
+	ctx->subscribe_params.value = BT_GATT_CCC_NOTIFY;
+#endif
+	ctx->subscribe_params.value_handle = ctx->handles.tx;
+	ctx->subscribe_params.ccc_handle = ctx->handles.ccc;
+
+	err = bt_gatt_subscribe(ctx->conn, &ctx->subscribe_params);
+	if (err && err != -EALREADY) {
+		ctx->subscribe_params.value_handle = 0;
+		return err;
+	}
+
+	return 0;
+}
+
+static u8_t nus_client_disc_svc(struct nus_client_ctx *ctx,
+				const struct bt_gatt_attr *attr)
+{
+	const struct bt_gatt_service_val *svc;
+	int err;
+
+	if (!attr) {
+		nus_client_fail(ctx, "service lookup", -ENOENT);
+		return BT_GATT_ITER_STOP;
+	}
+
+	svc = attr->user_data;
+	ctx->end_handle = svc->end_handle;
+	memset(&ctx->handles, 0, sizeof(ctx->handles));
+	ctx->tx_end_handle = 0;
+
+	NUS_LOG(GATT, DBG, "service %u-%u", attr->handle, ctx->end_handle);
+
+	/* Every characteristic of the service in one sweep */
+	ctx->discover_params.uuid = NULL;
+	ctx->discover_params.start_handle = attr->handle + 1;
+	ctx->discover_params.end_handle = ctx->end_handle;
+	ctx->discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+	ctx->state = NUS_CLIENT_DISC_CHRC;
+
+	err = bt_gatt_discover(ctx->conn, &ctx->discover_params);
+	if (err) {
+		nus_client_fail(ctx, "characteristic discovery", err);
+	}
+
+	return BT_GATT_ITER_STOP;
+}
+
+static u8_t nus_client_disc_chrc(struct nus_client_ctx *ctx,
+				 const struct bt_gatt_attr *attr)
+{
+	const struct bt_gatt_chrc *chrc;
+	int err;
+
+	if (attr) {
+		chrc = attr->user_data;
+
+		NUS_LOG(GATT, DBG, "characteristic %u", attr->handle);
+
+		/* The TX descriptors end where the next declaration starts */
+		if (ctx->handles.tx && !ctx->tx_end_handle) {
+			ctx->tx_end_handle = attr->handle - 1;
+		}
+
+		/* The host does not pass the value handle of a declaration
+		 * on, it is the handle right after it.
+		 */
+		if (!bt_uuid_cmp(chrc->uuid, BT_UUID_NUS_RX)) {
+			ctx->handles.rx = attr->handle + 1;
+		} else if (!bt_uuid_cmp(chrc->uuid, BT_UUID_NUS_TX)) {
+			ctx->handles.tx = attr->handle + 1;
+		}
+
+		return BT_GATT_ITER_CONTINUE;
+	}
+
+	if (!ctx->handles.rx || !ctx->handles.tx) {
+		nus_client_fail(ctx, "characteristic discovery", -ENOENT);
+		return BT_GATT_ITER_STOP;
+	}
+
+	memcpy(&ctx->ccc_uuid, BT_UUID_GATT_CCC, sizeof(ctx->ccc_uuid));
+	ctx->discover_params.uuid = &ctx->ccc_uuid.uuid;
+	ctx->discover_params.start_handle = ctx->handles.tx + 1;
+	ctx->discover_params.end_handle = ctx->tx_end_handle ?
+					  ctx->tx_end_handle : ctx->end_handle;
+	ctx->discover_params.type = BT_GATT_DISCOVER_DESCRIPTOR;
+	ctx->state = NUS_CLIENT_DISC_CCC;
+
+	err = bt_gatt_discover(ctx->conn, &ctx->discover_params);
+	if (err) {
+		nus_client_fail(ctx, "CCC discovery", err);
+	}
+
+	return BT_GATT_ITER_STOP;
+}
+
+static u8_t nus_client_disc_ccc(struct nus_client_ctx *ctx,
+				const struct bt_gatt_attr *attr)
+{
+	int err;
+
+	if (!attr) {
+		nus_client_fail(ctx, "CCC discovery", -ENOENT);
+		return BT_GATT_ITER_STOP;
+	}
+
+	NUS_LOG(GATT, DBG, "TX CCC %u", attr->handle);
+
+	ctx->handles.ccc = attr->handle;
+#if defined(CONFIG_NUS_CLIENT_HANDLE_CACHE)
+	nus_cache_store(bt_conn_get_dst(ctx->conn), &ctx->handles);
+#endif
+
+	err = nus_client_subscribe(ctx);
+	if (err) {
+		nus_client_fail(ctx, "subscription", err);
+		return BT_GATT_ITER_STOP;
+	}
+
+	nus_client_ready(ctx, false);
+
+	return BT_GATT_ITER_STOP;
+}
+
+static u8_t nus_client_discover_func(struct bt_conn *conn,
+				     const struct bt_gatt_attr *attr,
+				     struct bt_gatt_discover_params *params)
+{
+	struct nus_client_ctx *ctx = CONTAINER_OF(params, struct nus_client_ctx,
+						  discover_params);
+
+	switch (ctx->state) {
+	case NUS_CLIENT_DISC_SVC:
+		return nus_client_disc_svc(ctx, attr);
+	case NUS_CLIENT_DISC_CHRC:
+		return nus_client_disc_chrc(ctx, attr);
+	case NUS_CLIENT_DISC_CCC:
+		return nus_client_disc_ccc(ctx, attr);
+	default:
+		return BT_GATT_ITER_STOP;
+	}
+}
+
+static int nus_client_discover(struct nus_client_ctx *ctx)
+{
+	int err;
+
+	memcpy(&ctx->uuid, BT_UUID_NUS, sizeof(ctx->uuid));
+	ctx->discover_params.uuid = &ctx->uuid.uuid;
+	ctx->discover_params.func = nus_client_discover_func;
+	ctx->discover_params.start_handle = 0x0001;
+	ctx->discover_params.end_handle = 0xffff;
+	ctx->discover_params.type = BT_GATT_DISCOVER_PRIMARY;
+	ctx->state = NUS_CLIENT_DISC_SVC;
+
+	err = bt_gatt_discover(ctx->conn, &ctx->discover_params);
+	if (err) {
+		nus_client_fail(ctx, "service lookup", err);
+	}
+
+	return err;
+}
+
+#if defined(CONFIG_NUS_CLIENT_HANDLE_CACHE)
+/* Stale handles: forget them and fall back to a full discovery */
+static void nus_client_cache_fallback(struct nus_client_ctx *ctx)
+{
+	printk("Cached NUS handles are stale\n");
+
+	nus_cache_remove(bt_conn_get_dst(ctx->conn));
+
+	ctx->state = NUS_CLIENT_IDLE;
+	if (ctx->subscribe_params.value_handle) {
+		bt_gatt_unsubscribe(ctx->conn, &ctx->subscribe_params);
+	}
+
+	nus_client_discover(ctx);
+}
+
+static u8_t nus_client_validate_func(struct bt_conn *conn, u8_t err,
+				     struct bt_gatt_read_params *params,
+				     const void *data, u16_t length)
+{
+	struct nus_client_ctx *ctx = CONTAINER_OF(params, struct nus_client_ctx,
+						  read_params);
+	const u8_t *decl = data;
+
+	if (ctx->state != NUS_CLIENT_VALIDATING) {
+		return BT_GATT_ITER_STOP;
+	}
+
+	/* TX declaration: properties, value handle and 128-bit UUID */
+	if (!err && decl && length == 19 &&
+	    sys_get_le16(decl + 1) == ctx->handles.tx &&
+	    !memcmp(decl + 3, BT_UUID_128(BT_UUID_NUS_TX)->val, 16)) {
+		nus_client_ready(ctx, true);
+		return BT_GATT_ITER_STOP;
+	}
+
+	nus_client_cache_fallback(ctx);
+
+	return BT_GATT_ITER_STOP;
+}
+
+/* Subscribe straight to the cached handles. The subscription and the
+ * read validating the TX declaration go out back to back.
+ */
+static bool nus_client_subscribe_cached(struct nus_client_ctx *ctx)
+{
+	int err;
+
+	if (nus_cache_get(bt_conn_get_dst(ctx->conn), &ctx->handles)) {
+		return false;
+	}
+
+	err = nus_client_subscribe(ctx);
+	if (err) {
+		printk("NUS subscription failed (err %d)\n", err);
+		return false;
+	}
+
+	ctx->read_params.func = nus_client_validate_func;
+	ctx->read_params.handle_count = 1;
+	ctx->read_params.single.handle = ctx->handles.tx - 1;
+	ctx->read_params.single.offset = 0;
+
+	err = bt_gatt_read(ctx->conn, &ctx->read_params);
+	if (err) {
+		printk("NUS validation failed (err %d)\n", err);
+		bt_gatt_unsubscribe(ctx->conn, &ctx->subscribe_params);
+		return false;
+	}
+
+	ctx->state = NUS_CLIENT_VALIDATING;
+
+	return true;
+}
+#endif /* CONFIG_NUS_CLIENT_HANDLE_CACHE */
+
+static u8_t nus_client_notify_func(struct bt_conn *conn,
+				   struct bt_gatt_subscribe_params *params,
+				   const void *data, u16_t length)
+{
+	struct nus_client_ctx *ctx = CONTAINER_OF(params, struct nus_client_ctx,
+						  subscribe_params);
+
+	if (!data) {
+		params->value_handle = 0;
+#if defined(CONFIG_NUS_CLIENT_HANDLE_CACHE)
+		/* The CCC write to a cached handle failed */
+		if (ctx->state == NUS_CLIENT_VALIDATING) {
+			nus_client_cache_fallback(ctx);
+		}
+#endif
+		return BT_GATT_ITER_STOP;
+	}
+
+#if defined(CONFIG_NUS_CREDITS)
+	if (nus_client_credit_frame(ctx, data, length)) {
+		return BT_GATT_ITER_CONTINUE;
+	}
+#endif
+
+#if defined(CONFIG_NUS_COMPRESS)
+	if (nus_client_comp_rx(ctx, data, length)) {
+		return BT_GATT_ITER_CONTINUE;
+	}
+#endif
+
+	if (nus_client_cb && nus_client_cb->data) {
+		nus_client_cb->data(conn, data, length);
+	}
+
+	return BT_GATT_ITER_CONTINUE;
+}
+
+s32_t nus_client_start(struct bt_conn *conn)
+{
+	struct nus_client_ctx *ctx = nus_client_get(conn);
+
+	if (!ctx) {
+		ctx = nus_client_alloc(conn);
+		if (!ctx) {
+			return -ENOMEM;
+		}
+	} else if (ctx->state != NUS_CLIENT_IDLE) {
+		return -EALREADY;
+	}
+
+	ctx->started = true;
+
+#if defined(CONFIG_NUS_CLIENT_HANDLE_CACHE)
+	if (nus_client_subscribe_cached(ctx)) {
+		return 0;
+	}
+#endif
+
+	return nus_client_discover(ctx);
+}
+
+u16_t nus_client_payload_len(struct bt_conn *conn)
+{
+	/* Never exceed what fits into one of our own L2CAP TX buffers */
+	return min(bt_gatt_get_mtu(conn), CONFIG_BT_L2CAP_TX_MTU) - 3;
+}
+
+s32_t nus_client_send(struct bt_conn *conn, const void *data, u16_t len)
+{
+	struct nus_client_ctx *ctx = nus_client_get(conn);
+	const u8_t *p = data;
+	u16_t chunk, n;
+	u16_t sent = 0;
+	int err = 0;
+
+	if (!ctx || ctx->state != NUS_CLIENT_READY) {
+		return -ENOTCONN;
+	}
+
+	chunk = nus_client_payload_len(conn);
+
+	while (sent < len) {
+#if defined(CONFIG_NUS_CREDITS)
+		if (!nus_client_credit_take(ctx)) {
+			err = -EAGAIN;
+			break;
+		}
+#endif
+
+		n = min(chunk, len - sent);
+
+#if defined(CONFIG_NUS_COMPRESS)
+		/* The peer would take it for a capability frame, split it one
+		 * byte earlier
+		 */
+		if (n == sizeof(struct nus_caps_frame) &&
+		    sys_get_le16(p + sent) == NUS_CAPS_MAGIC) {
+			n--;
+		}
+#endif
+
+		err = bt_gatt_write_without_response(conn, ctx->handles.rx,
+						     p + sent, n, false);
+		if (err) {
+#if defined(CONFIG_NUS_CREDITS)
+			/* Not sent, the credit is still ours */
+			atomic_inc(&ctx->credits);
+#endif
+			break;
+		}
+
+		sent += n;
+	}
+
+	return sent ? sent : err;
+}
+
+#if defined(CONFIG_NUS_COMPRESS)
+s32_t nus_client_comp_stats_get(struct bt_conn *conn,
+				struct nus_client_comp_stats *stats)
+{
+	struct nus_client_ctx *ctx = nus_client_get(conn);
+
+	if (!ctx) {
+		return -ENOTCONN;
+	}
+
+	*stats = ctx->comp_stats;
+
+	return 0;
+}
+#endif
+
+u16_t nus_client_credits(struct bt_conn *conn)
+{
+#if defined(CONFIG_NUS_CREDITS)
+	struct nus_client_ctx *ctx = nus_client_get(conn);
+
+	return ctx ? min(atomic_get(&ctx->credits), UINT16_MAX) : 0;
+#else
+	return UINT16_MAX;
+#endif
+}
+
+static void nus_client_connected(struct bt_conn *conn, u8_t err)
+{
+	struct bt_conn_info info;
+	struct nus_client_ctx *ctx;
+
+	if (err || bt_conn_get_info(conn, &info) ||
+	    info.role != BT_CONN_ROLE_MASTER) {
+		return;
+	}
+
+	ctx = nus_client_alloc(conn);
+	if (!ctx) {
+		return;
+	}
+
+	nus_client_mtu_exchange(ctx);
+}
+
+static void nus_client_disconnected(struct bt_conn *conn, u8_t reason)
+{
+	struct nus_client_ctx *ctx = nus_client_get(conn);
+
+	if (!ctx) {
+		return;
+	}
+
+	/* The host keeps subscriptions of bonded peers across disconnects,
+	 * take ours out of its list before the slot is reused.
+	 */
+	if (ctx->subscribe_params.value_handle) {
+		bt_gatt_unsubscribe(conn, &ctx->subscribe_params);
+	}
+
+#if defined(CONFIG_NUS_COMPRESS)
+	if (ctx->comp_stats.out_bytes) {
+		printk("NUS decompressed %u to %u bytes, %u us per KB\n",
+		       ctx->comp_stats.in_bytes, ctx->comp_stats.out_bytes,
+		       (u32_t)((u64_t)ctx->comp_stats.cycles * USEC_PER_SEC /
+			       sys_clock_hw_cycles_per_sec * 1024 /
+			       ctx->comp_stats.out_bytes));
+	}
+#endif
+
+	ctx->state = NUS_CLIENT_IDLE;
+	ctx->conn = NULL;
+
+	if (ctx->started && nus_client_cb && nus_client_cb->disconnected) {
+		nus_client_cb->disconnected(conn);
+	}
+
+	bt_conn_unref(conn);
+}
+
+#if defined(CONFIG_BT_SMP)
+static void nus_client_security_changed(struct bt_conn *conn,
+					bt_security_t level)
+{
+	struct nus_client_ctx *ctx = nus_client_get(conn);
+
+	/* Peers that refuse ATT before pairing get a second chance */
+	if (ctx) {
+		nus_client_mtu_exchange(ctx);
+	}
+}
+#endif
+
+static struct bt_conn_cb nus_client_conn_callbacks = {
+	.connected = nus_client_connected,
+	.disconnected = nus_client_disconnected,
+#if defined(CONFIG_BT_SMP)
+	.security_changed = nus_client_security_changed,
+#endif
+};
+
+void nus_client_init(const struct nus_client_cb *cb)
+{
+	nus_client_cb = cb;
+
+	bt_conn_cb_register(&nus_client_conn_callbacks);
+}
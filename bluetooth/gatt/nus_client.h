@@ -0,0 +1,111 @@
+/** @file
+ *  @brief Nordic NUS client
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __NUS_CLIENT_H
+#define __NUS_CLIENT_H
+
+#include <bluetooth/conn.h>
+
+/**@brief   NUS client callbacks, all called from the BT RX thread. */
+struct nus_client_cb
+{
+    /** The link is subscribed to NUS TX and accepts
+     *  @ref nus_client_send. @p cached is set when the handles came from
+     *  the handle cache rather than service discovery. */
+    void (*ready)(struct bt_conn *conn, bool cached);
+    /** A notification was received on NUS TX. Credit and capability
+     *  frames are consumed by the client and not reported. With
+     *  CONFIG_NUS_COMPRESS a compressed notification may be reported in
+     *  several pieces, each up to CONFIG_NUS_COMPRESS_WINDOW bytes and so
+     *  possibly longer than the ATT MTU. */
+    void (*data)(struct bt_conn *conn, const void *data, u16_t len);
+    /** The ATT MTU exchange the client starts on every link it
+     *  initiated completed, @p payload_len is @ref nus_client_payload_len
+     *  from now on. */
+    void (*payload_len)(struct bt_conn *conn, u16_t payload_len);
+    /** A link passed to @ref nus_client_start was disconnected. */
+    void (*disconnected)(struct bt_conn *conn);
+};
+
+/**@brief   Compression statistics of a link, see CONFIG_NUS_COMPRESS. */
+struct nus_client_comp_stats
+{
+    u32_t in_bytes;  /**< Compressed notifications received, headers
+                          included. */
+    u32_t out_bytes; /**< Bytes they decoded to. */
+    u32_t cycles;    /**< Hardware cycles spent decoding. */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@brief   Register the callbacks and the connection callbacks of the
+ *          client.
+ *
+ * @details The client raises the ATT MTU of every link it initiates as
+ *          soon as it is connected, and once more after a security change
+ *          if the peer refused it before pairing.
+ */
+void nus_client_init(const struct nus_client_cb *cb);
+
+/**@brief   Look up NUS on a peer and subscribe to it.
+ *
+ * @details Call once the link reaches the security NUS needs. Handles of
+ *          bonded peers are taken from the handle cache when possible,
+ *          otherwise the service, its characteristics and the TX CCC are
+ *          discovered, the characteristics in a single sweep. The ready
+ *          callback reports the outcome.
+ *
+ * @return  0 if the lookup started, -EALREADY if it ran already on
+ *          @p conn, -ENOMEM without a free slot, or a GATT error.
+ */
+s32_t nus_client_start(struct bt_conn *conn);
+
+/**@brief   Get the largest write payload to a peer.
+ *
+ * @details The ATT MTU minus the 3 byte write header, capped to what fits
+ *          into one of our L2CAP TX buffers.
+ */
+u16_t nus_client_payload_len(struct bt_conn *conn);
+
+/**@brief   Send a buffer to the RX characteristic of a peer.
+ *
+ * @details The buffer is split into Write Commands of up to
+ *          @ref nus_client_payload_len bytes, which are queued back to back
+ *          without waiting for each other. With CONFIG_NUS_CREDITS each of
+ *          them takes a credit and sending stops when the peer has granted
+ *          none. With CONFIG_NUS_COMPRESS a write that would look like a
+ *          capability frame is split one byte earlier.
+ *
+ * @return  Number of bytes queued, or a negative error if nothing could be
+ *          sent: -EAGAIN without credits, -ENOMEM out of host buffers,
+ *          -ENOTCONN if the link is not ready.
+ */
+s32_t nus_client_send(struct bt_conn *conn, const void *data, u16_t len);
+
+/**@brief   Get the number of Write Commands the peer accepts right now.
+ *
+ * @return  The credits left, or UINT16_MAX without CONFIG_NUS_CREDITS.
+ */
+u16_t nus_client_credits(struct bt_conn *conn);
+
+/**@brief   Get the compression statistics of a link.
+ *
+ * @details The ratio achieved is out_bytes / in_bytes. All zero while the
+ *          peer sends plain data.
+ */
+s32_t nus_client_comp_stats_get(struct bt_conn *conn,
+                                struct nus_client_comp_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NUS_CLIENT_H */
@@ -0,0 +1,218 @@
+/** @file
+ *  @brief Nordic NUS stream compression
+ *
+ *  A byte oriented LZ77 codec for NUS streams, small enough to run on every
+ *  notification. A block is a sequence of tokens:
+ *
+ *  - 0LLLLLLL: L + 1 literal bytes follow.
+ *  - 1LLLLDDD DDDDDDDD: copy L + 3 bytes from D + 1 bytes back.
+ *
+ *  Matches reach back into the previous blocks of the stream, up to
+ *  NUS_COMP_WINDOW bytes, and may overlap the bytes they produce. The
+ *  encoder finds them through a hash of the next three bytes, so encoding
+ *  is a single pass with one candidate per position.
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <zephyr.h>
+
+#include "nus_comp.h"
+
+#define NUS_COMP_MATCH		0x80
+#define NUS_COMP_MIN_MATCH	3
+#define NUS_COMP_MAX_MATCH	(NUS_COMP_MIN_MATCH + 15)
+#define NUS_COMP_MAX_LITERALS	128
+#define NUS_COMP_MAX_DIST	2048
+#define NUS_COMP_MASK		(NUS_COMP_WINDOW - 1)
+
+BUILD_ASSERT_MSG((NUS_COMP_WINDOW & NUS_COMP_MASK) == 0,
+		 "CONFIG_NUS_COMPRESS_WINDOW must be a power of two");
+BUILD_ASSERT_MSG(NUS_COMP_WINDOW <= NUS_COMP_MAX_DIST,
+		 "CONFIG_NUS_COMPRESS_WINDOW exceeds the match distance");
+
+static inline u32_t nus_comp_hash(const u8_t *p)
+{
+	u32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+
+	return (v * 2654435761U) >> (32 - NUS_COMP_HASH_BITS);
+}
+
+void nus_comp_enc_init(struct nus_comp_enc *enc)
+{
+	/* Stale hash entries are harmless, every candidate is verified */
+	memset(enc, 0, sizeof(*enc));
+}
+
+/* Length of the match at dist bytes back, bounded by max. Bytes that are
+ * not in the window yet are those the match itself produces.
+ */
+static u16_t nus_comp_match(const struct nus_comp_enc *enc, const u8_t *src,
+			    u32_t dist, u16_t max)
+{
+	u16_t len;
+	u8_t c;
+
+	for (len = 0; len < max; len++) {
+		if (len < dist) {
+			c = enc->win[(enc->pos - dist + len) & NUS_COMP_MASK];
+		} else {
+			c = src[len - dist];
+		}
+
+		if (c != src[len]) {
+			break;
+		}
+	}
+
+	return len;
+}
+
+/* Take one byte into the window, and its prefix into the match finder if
+ * the next three bytes are known
+ */
+static inline void nus_comp_enc_push(struct nus_comp_enc *enc,
+				     const u8_t *src, u16_t left)
+{
+	if (left >= NUS_COMP_MIN_MATCH) {
+		enc->hash[nus_comp_hash(src)] = enc->pos;
+	}
+
+	enc->win[enc->pos & NUS_COMP_MASK] = *src;
+	enc->pos++;
+}
+
+u16_t nus_comp_encode(struct nus_comp_enc *enc, const u8_t *src,
+		      u16_t *src_len, u8_t *dst, u16_t dst_len)
+{
+	u16_t in = 0, out = 0;
+	u16_t lit = 0;
+	bool lit_open = false;
+	u16_t len, max;
+	u32_t dist;
+
+	while (in < *src_len) {
+		max = min(*src_len - in, NUS_COMP_MAX_MATCH);
+		len = 0;
+
+		if (max >= NUS_COMP_MIN_MATCH) {
+			dist = (u16_t)(enc->pos - enc->hash[nus_comp_hash(src + in)]);
+			if (dist && dist <= min(enc->pos, NUS_COMP_WINDOW)) {
+				len = nus_comp_match(enc, src + in, dist, max);
+			}
+		}
+
+		if (len >= NUS_COMP_MIN_MATCH) {
+			if (out + 2 > dst_len) {
+				break;
+			}
+
+			dst[out++] = NUS_COMP_MATCH |
+				     ((len - NUS_COMP_MIN_MATCH) << 3) |
+				     ((dist - 1) >> 8);
+			dst[out++] = (dist - 1) & 0xff;
+			lit_open = false;
+
+			while (len--) {
+				nus_comp_enc_push(enc, src + in, *src_len - in);
+				in++;
+			}
+
+			continue;
+		}
+
+		/* Extend the open literal run, or start a new one */
+		if (lit_open && dst[lit] < NUS_COMP_MAX_LITERALS - 1) {
+			if (out + 1 > dst_len) {
+				break;
+			}
+
+			dst[lit]++;
+		} else {
+			if (out + 2 > dst_len) {
+				break;
+			}
+
+			lit = out++;
+			dst[lit] = 0;
+			lit_open = true;
+		}
+
+		dst[out++] = src[in];
+		nus_comp_enc_push(enc, src + in, *src_len - in);
+		in++;
+	}
+
+	*src_len = in;
+
+	return out;
+}
+
+void nus_comp_dec_init(struct nus_comp_dec *dec)
+{
+	dec->pos = 0;
+}
+
+s32_t nus_comp_decode(struct nus_comp_dec *dec, const u8_t *src, u16_t len,
+		      nus_comp_sink_t sink, void *user_data)
+{
+	u32_t start = dec->pos;
+	u32_t flushed = dec->pos;
+	u16_t in = 0;
+	u16_t n;
+	u32_t dist;
+	u8_t ctrl;
+
+	while (in < len) {
+		ctrl = src[in++];
+
+		if (ctrl & NUS_COMP_MATCH) {
+			if (in == len) {
+				return -EINVAL;
+			}
+
+			n = ((ctrl >> 3) & 0x0f) + NUS_COMP_MIN_MATCH;
+			dist = (((ctrl & 0x07) << 8) | src[in++]) + 1;
+			if (dist > min(dec->pos, NUS_COMP_WINDOW)) {
+				return -EINVAL;
+			}
+		} else {
+			n = ctrl + 1;
+			if (n > len - in) {
+				return -EINVAL;
+			}
+
+			dist = 0;
+		}
+
+		while (n--) {
+			dec->win[dec->pos & NUS_COMP_MASK] = dist ?
+				dec->win[(dec->pos - dist) & NUS_COMP_MASK] :
+				src[in++];
+			dec->pos++;
+
+			/* Hand the data over before the window wraps onto it */
+			if (!(dec->pos & NUS_COMP_MASK)) {
+				sink(user_data,
+				     &dec->win[flushed & NUS_COMP_MASK],
+				     dec->pos - flushed);
+				flushed = dec->pos;
+			}
+		}
+	}
+
+	if (dec->pos != flushed) {
+		sink(user_data, &dec->win[flushed & NUS_COMP_MASK],
+		     dec->pos - flushed);
+	}
+
+	return dec->pos - start;
+}
@@ -0,0 +1,90 @@
+/** @file
+ *  @brief Nordic NUS stream compression
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __NUS_COMP_H
+#define __NUS_COMP_H
+
+#include <zephyr/types.h>
+
+/** @def NUS_COMP_WINDOW
+ *  @brief Bytes of history a match may reach back, see
+ *         CONFIG_NUS_COMPRESS_WINDOW
+ */
+#define NUS_COMP_WINDOW        CONFIG_NUS_COMPRESS_WINDOW
+
+/** @def NUS_COMP_HASH_BITS
+ *  @brief Size of the match finder of the encoder, log2
+ */
+#define NUS_COMP_HASH_BITS     8
+
+/**@brief   Encoder state of one stream.
+ *
+ * @details The encoder and the decoder of a stream keep the same window,
+ *          so matches reach back across notifications. Every encoded block
+ *          must reach the decoder, in order.
+ */
+struct nus_comp_enc
+{
+    u32_t pos;                              /**< Bytes encoded so far. */
+    u16_t hash[1 << NUS_COMP_HASH_BITS];    /**< Last position of each
+                                                 3 byte prefix hash. */
+    u8_t  win[NUS_COMP_WINDOW];             /**< Last bytes encoded. */
+};
+
+/**@brief   Decoder state of one stream. */
+struct nus_comp_dec
+{
+    u32_t pos;                              /**< Bytes decoded so far. */
+    u8_t  win[NUS_COMP_WINDOW];             /**< Last bytes decoded. */
+};
+
+/**@brief   Receives decoded data, in pieces of up to @ref NUS_COMP_WINDOW
+ *          bytes.
+ */
+typedef void (* nus_comp_sink_t) (void *user_data, const u8_t *data, u16_t len);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@brief   Start a new stream. */
+void nus_comp_enc_init(struct nus_comp_enc *enc);
+
+/**@brief   Compress as much of @p src as fits into @p dst.
+ *
+ * @details Stops when @p dst is full or @p src is used up, so a block can
+ *          be filled up to a notification payload from a stream of any
+ *          length.
+ *
+ * @param   src_len In: bytes available in @p src. Out: bytes consumed.
+ *
+ * @return  Number of bytes written to @p dst.
+ */
+u16_t nus_comp_encode(struct nus_comp_enc *enc, const u8_t *src,
+                      u16_t *src_len, u8_t *dst, u16_t dst_len);
+
+/**@brief   Start a new stream. */
+void nus_comp_dec_init(struct nus_comp_dec *dec);
+
+/**@brief   Decompress one block, passing the data to @p sink.
+ *
+ * @details Decodes straight into the window, no buffer for the output of a
+ *          whole block is needed.
+ *
+ * @return  Number of bytes decoded, or -EINVAL if the block is corrupt, in
+ *          which case the stream cannot be decoded any further.
+ */
+s32_t nus_comp_decode(struct nus_comp_dec *dec, const u8_t *src, u16_t len,
+                      nus_comp_sink_t sink, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NUS_COMP_H */
@@ -0,0 +1,244 @@
+/** @file
+ *  @brief Nordic NUS message framing
+ *
+ *  Messages of any length up to CONFIG_NUS_FRAME_MAX_LEN are cut into
+ *  fragments of one notification or write each. Every fragment starts with
+ *  a sequence number, the first one with the message length as well:
+ *
+ *  - first:  seq, flags, length (le16), data
+ *  - others: seq, flags, data
+ *
+ *  A receiver that misses a fragment sees the sequence number jump and
+ *  drops the message it was reassembling instead of delivering a spliced
+ *  one, then picks up again at the next first fragment.
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <misc/byteorder.h>
+#include <zephyr.h>
+#include <net/buf.h>
+
+#include "nus_frame.h"
+
+#define NUS_FRAME_CRC_LEN	sizeof(u16_t)
+
+/* CRC-16/CCITT, polynomial 0x1021, a byte at a time without a table */
+static u16_t nus_frame_crc(u16_t crc, const u8_t *p, u16_t len)
+{
+	while (len--) {
+		crc = (crc >> 8) | (crc << 8);
+		crc ^= *p++;
+		crc ^= (crc & 0xff) >> 4;
+		crc ^= crc << 12;
+		crc ^= (crc & 0xff) << 5;
+	}
+
+	return crc;
+}
+
+void nus_frame_tx_init(struct nus_frame_tx *tx)
+{
+	tx->seq = 0;
+}
+
+s32_t nus_frame_send(struct nus_frame_tx *tx, const void *data, u16_t len,
+		     bool crc, u16_t frag_len, nus_frame_out_t out,
+		     void *user_data)
+{
+	u8_t frag[NUS_FRAME_FRAG_MAX];
+	const u8_t *p = data;
+	u16_t sent = 0;
+	u16_t n, chunk;
+	u8_t flags = NUS_FRAME_FIRST | (crc ? NUS_FRAME_CRC : 0);
+	s32_t err;
+
+	if (len > CONFIG_NUS_FRAME_MAX_LEN) {
+		return -EMSGSIZE;
+	}
+
+	if (frag_len < NUS_FRAME_FRAG_MIN) {
+		return -EINVAL;
+	}
+
+	frag_len = min(frag_len, sizeof(frag));
+
+	do {
+		n = sizeof(struct nus_frame_hdr);
+		frag[0] = tx->seq;
+
+		if (flags & NUS_FRAME_FIRST) {
+			sys_put_le16(len, &frag[n]);
+			n += sizeof(u16_t);
+		}
+
+		chunk = min(frag_len - n, len - sent);
+		memcpy(&frag[n], p + sent, chunk);
+		n += chunk;
+		sent += chunk;
+
+		/* Keep the CRC in one piece, in a fragment of its own if
+		 * need be
+		 */
+		if (sent == len &&
+		    (!crc || frag_len - n >= NUS_FRAME_CRC_LEN)) {
+			if (crc) {
+				sys_put_le16(nus_frame_crc(0xffff, p, len),
+					     &frag[n]);
+				n += NUS_FRAME_CRC_LEN;
+			}
+
+			flags |= NUS_FRAME_LAST;
+		}
+
+		frag[1] = flags;
+
+		err = out(user_data, frag, n);
+		if (err < 0) {
+			return err;
+		}
+
+		tx->seq++;
+		flags &= ~(NUS_FRAME_FIRST | NUS_FRAME_CRC);
+	} while (!(flags & NUS_FRAME_LAST));
+
+	return 0;
+}
+
+/* Forget the message being reassembled */
+static void nus_frame_rx_drop(struct nus_frame_rx *rx)
+{
+	if (rx->busy) {
+		rx->dropped++;
+	}
+
+	if (rx->head) {
+		net_buf_unref(rx->head);
+		rx->head = NULL;
+	}
+
+	rx->busy = 0;
+}
+
+void nus_frame_rx_init(struct nus_frame_rx *rx)
+{
+	if (rx->head) {
+		net_buf_unref(rx->head);
+	}
+
+	memset(rx, 0, sizeof(*rx));
+}
+
+/* Check and strip the CRC, which is all in the last fragment */
+static bool nus_frame_rx_crc(struct nus_frame_rx *rx)
+{
+	struct net_buf *last = net_buf_frag_last(rx->head);
+	struct net_buf *frag;
+	u16_t crc = 0xffff;
+
+	if (last->len < NUS_FRAME_CRC_LEN) {
+		return false;
+	}
+
+	last->len -= NUS_FRAME_CRC_LEN;
+
+	for (frag = rx->head; frag; frag = frag->frags) {
+		crc = nus_frame_crc(crc, frag->data, frag->len);
+	}
+
+	return crc == sys_get_le16(last->data + last->len);
+}
+
+s32_t nus_frame_rx_buf(struct nus_frame_rx *rx, struct net_buf *buf,
+		       nus_frame_msg_t cb, void *user_data)
+{
+	u16_t body;
+	u8_t seq, flags;
+
+	if (buf->len < sizeof(struct nus_frame_hdr)) {
+		net_buf_unref(buf);
+		nus_frame_rx_drop(rx);
+		return -EINVAL;
+	}
+
+	seq = net_buf_pull_u8(buf);
+	flags = net_buf_pull_u8(buf);
+
+	if (rx->synced && seq != rx->seq) {
+		rx->gaps++;
+		nus_frame_rx_drop(rx);
+	}
+
+	rx->synced = 1;
+	rx->seq = seq + 1;
+
+	if (flags & NUS_FRAME_FIRST) {
+		/* The rest of the previous message was never sent */
+		nus_frame_rx_drop(rx);
+
+		if (buf->len < sizeof(u16_t)) {
+			net_buf_unref(buf);
+			return -EINVAL;
+		}
+
+		rx->len = net_buf_pull_le16(buf);
+		rx->crc = !!(flags & NUS_FRAME_CRC);
+		rx->got = 0;
+		rx->busy = 1;
+	} else if (!rx->busy) {
+		/* Rest of a message whose start is lost */
+		net_buf_unref(buf);
+		return 0;
+	}
+
+	body = rx->len + (rx->crc ? NUS_FRAME_CRC_LEN : 0);
+
+	if (rx->len > CONFIG_NUS_FRAME_MAX_LEN || buf->len > body - rx->got) {
+		net_buf_unref(buf);
+		nus_frame_rx_drop(rx);
+		return 0;
+	}
+
+	rx->got += buf->len;
+
+	/* Chain the fragment instead of copying it out */
+	if (!buf->len) {
+		net_buf_unref(buf);
+	} else if (!rx->head) {
+		rx->head = buf;
+	} else {
+		net_buf_frag_insert(net_buf_frag_last(rx->head), buf);
+	}
+
+	if (!(flags & NUS_FRAME_LAST)) {
+		return 0;
+	}
+
+	if (rx->got != body) {
+		nus_frame_rx_drop(rx);
+		return 0;
+	}
+
+	if (rx->crc && !nus_frame_rx_crc(rx)) {
+		rx->crc_errors++;
+		nus_frame_rx_drop(rx);
+		return 0;
+	}
+
+	rx->messages++;
+	cb(user_data, rx->head, rx->len);
+
+	/* Counted as delivered, not dropped */
+	rx->busy = 0;
+	nus_frame_rx_drop(rx);
+
+	return 0;
+}
@@ -0,0 +1,147 @@
+/** @file
+ *  @brief Nordic NUS message framing
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __NUS_FRAME_H
+#define __NUS_FRAME_H
+
+#include <zephyr/types.h>
+#include <net/buf.h>
+
+/** @def NUS_FRAME_FIRST
+ *  @brief Fragment flag, the fragment starts a message
+ */
+#define NUS_FRAME_FIRST        BIT(0)
+/** @def NUS_FRAME_LAST
+ *  @brief Fragment flag, the fragment ends a message
+ */
+#define NUS_FRAME_LAST         BIT(1)
+/** @def NUS_FRAME_CRC
+ *  @brief Fragment flag, set on the first fragment if the message ends
+ *         with a CRC
+ */
+#define NUS_FRAME_CRC          BIT(2)
+
+/** @def NUS_FRAME_FRAG_MAX
+ *  @brief Largest fragment, a notification or write of the largest ATT MTU
+ */
+#define NUS_FRAME_FRAG_MAX     (CONFIG_BT_L2CAP_TX_MTU - 3)
+
+/** @def NUS_FRAME_FRAG_MIN
+ *  @brief Smallest fragment length @ref nus_frame_send accepts
+ */
+#define NUS_FRAME_FRAG_MIN     8
+
+/**@brief   Header of every fragment.
+ *
+ * @details One fragment is sent per notification or write. seq counts the
+ *          fragments of a link and direction, so a jump tells the receiver
+ *          that fragments were lost or reordered.
+ */
+struct nus_frame_hdr
+{
+    u8_t  seq;   /**< Fragment sequence number, wraps around. */
+    u8_t  flags; /**< NUS_FRAME_* flags. */
+} __packed;
+
+/**@brief   Header of the first fragment of a message.
+ *
+ * @details The message follows, then its CRC-16/CCITT, little endian, if
+ *          @ref NUS_FRAME_CRC is set. The CRC never spans two fragments.
+ */
+struct nus_frame_first
+{
+    struct nus_frame_hdr hdr;
+    u16_t len;   /**< Message length, without the CRC. */
+} __packed;
+
+/**@brief   Sending state of one link. */
+struct nus_frame_tx
+{
+    u8_t seq;                  /**< Sequence number of the next fragment. */
+};
+
+/**@brief   Receiving state of one link.
+ *
+ * @details Owned by the thread feeding it. A message is kept as a chain of
+ *          the fragment buffers while it is reassembled.
+ */
+struct nus_frame_rx
+{
+    struct net_buf *head;      /**< Fragments received so far. */
+    u16_t len;                 /**< Message length, header and CRC
+                                    excluded. */
+    u16_t got;                 /**< Bytes received, CRC included. */
+    u8_t  seq;                 /**< Expected sequence number. */
+    u8_t  synced:1;            /**< A fragment was received before. */
+    u8_t  busy:1;              /**< A message is being reassembled. */
+    u8_t  crc:1;               /**< The message carries a CRC. */
+    u32_t messages;            /**< Messages delivered. */
+    u32_t gaps;                /**< Sequence number jumps. */
+    u32_t dropped;             /**< Messages lost to a gap, cut short or
+                                    too long. */
+    u32_t crc_errors;          /**< Messages failing their CRC. */
+};
+
+/**@brief   Sends one fragment, returns a negative error if it could not be
+ *          queued.
+ */
+typedef s32_t (* nus_frame_out_t) (void *user_data, const u8_t *data, u16_t len);
+
+/**@brief   Receives a reassembled message.
+ *
+ * @details @p msg is a chain of fragment buffers holding exactly the
+ *          @p len bytes of the message, NULL or empty if the message is.
+ *          It is released after the call, take a reference with
+ *          net_buf_ref() to keep it.
+ */
+typedef void (* nus_frame_msg_t) (void *user_data, struct net_buf *msg, u16_t len);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**@brief   Start sending on a new link. */
+void nus_frame_tx_init(struct nus_frame_tx *tx);
+
+/**@brief   Split a message into fragments and pass them to @p out.
+ *
+ * @details Fragments are up to @p frag_len bytes, so that each one goes out
+ *          as a single notification or write. A message whose fragments
+ *          were not all sent is detected by the receiver.
+ *
+ * @return  0 if every fragment was sent, -EMSGSIZE if @p len exceeds
+ *          CONFIG_NUS_FRAME_MAX_LEN, -EINVAL if @p frag_len is below
+ *          @ref NUS_FRAME_FRAG_MIN, or the error of @p out.
+ */
+s32_t nus_frame_send(struct nus_frame_tx *tx, const void *data, u16_t len,
+                     bool crc, u16_t frag_len, nus_frame_out_t out,
+                     void *user_data);
+
+/**@brief   Start receiving on a new link, dropping any partial message and
+ *          clearing the counters.
+ */
+void nus_frame_rx_init(struct nus_frame_rx *rx);
+
+/**@brief   Take one received fragment.
+ *
+ * @details Takes over the reference to @p buf, whose data starts with the
+ *          fragment header. The payload is chained to the message being
+ *          reassembled rather than copied, and @p cb is called once the
+ *          message is complete.
+ *
+ * @return  0, or -EINVAL if the fragment is malformed.
+ */
+s32_t nus_frame_rx_buf(struct nus_frame_rx *rx, struct net_buf *buf,
+                       nus_frame_msg_t cb, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NUS_FRAME_H */
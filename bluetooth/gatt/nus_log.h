@@ -0,0 +1,76 @@
+/** @file
+ *  @brief Nordic NUS sample logging
+ *
+ *  Category based logging for the NUS samples. Every category has its own
+ *  compile-time level, CONFIG_NUS_LOG_LEVEL_<category>; a message above it
+ *  is a constant-false branch and is removed by the compiler together with
+ *  its format string, so disabled categories cost nothing at runtime.
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __NUS_LOG_H
+#define __NUS_LOG_H
+
+#include <zephyr/types.h>
+#include <misc/printk.h>
+#include <kernel.h>
+
+/** @def NUS_LOG_LEVEL_ERR
+ *  @brief Levels, with the same numbering as SYS_LOG
+ */
+#define NUS_LOG_LEVEL_ERR      1
+#define NUS_LOG_LEVEL_WRN      2
+#define NUS_LOG_LEVEL_INF      3
+#define NUS_LOG_LEVEL_DBG      4
+
+/** @def NUS_LOG_LEVEL_DATA
+ *  @brief Per packet traffic
+ */
+#define NUS_LOG_LEVEL_DATA     CONFIG_NUS_LOG_LEVEL_DATA
+/** @def NUS_LOG_LEVEL_SCAN
+ *  @brief Advertising reports
+ */
+#define NUS_LOG_LEVEL_SCAN     CONFIG_NUS_LOG_LEVEL_SCAN
+/** @def NUS_LOG_LEVEL_GATT
+ *  @brief Service discovery
+ */
+#define NUS_LOG_LEVEL_GATT     CONFIG_NUS_LOG_LEVEL_GATT
+
+/** @def NUS_LOG
+ *  @brief Log to a category, e.g. NUS_LOG(DATA, DBG, "len %u", len)
+ */
+#define NUS_LOG(_cat, _lvl, _fmt, ...)					\
+	do {								\
+		if (NUS_LOG_LEVEL_##_lvl <= NUS_LOG_LEVEL_##_cat) {	\
+			printk("[" #_cat "] " _fmt "\n", ##__VA_ARGS__);	\
+		}							\
+	} while (0)
+
+/** @def NUS_LOG_RATELIMIT
+ *  @brief Like @ref NUS_LOG, but each call site prints at most once per
+ *         CONFIG_NUS_LOG_RATELIMIT_MS and reports how many were skipped
+ */
+#define NUS_LOG_RATELIMIT(_cat, _lvl, _fmt, ...)			\
+	do {								\
+		if (NUS_LOG_LEVEL_##_lvl <= NUS_LOG_LEVEL_##_cat) {	\
+			static u32_t _last, _skipped;			\
+			u32_t _now = k_uptime_get_32();			\
+									\
+			if (_last && _now - _last <			\
+			    CONFIG_NUS_LOG_RATELIMIT_MS) {		\
+				_skipped++;				\
+				break;					\
+			}						\
+									\
+			printk("[" #_cat "] " _fmt " (%u skipped)\n",	\
+			       ##__VA_ARGS__, _skipped);		\
+			_last = _now ? _now : 1;			\
+			_skipped = 0;					\
+		}							\
+	} while (0)
+
+#endif /* __NUS_LOG_H */
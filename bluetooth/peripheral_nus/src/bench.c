@@ -0,0 +1,260 @@
+/** @file
+ *  @brief Nordic NUS peripheral benchmark responder
+ *
+ *  Answers the benchmark frames written by the central NUS sample: PINGs
+ *  are echoed with both local timestamps, START streams timestamped DATA
+ *  frames for the requested time and ends with a DONE frame.
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#if defined(CONFIG_NUS_BENCH)
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <misc/printk.h>
+#include <misc/byteorder.h>
+#include <zephyr.h>
+#include <atomic.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+
+#include <gatt/nus.h>
+#include <gatt/nus_bench.h>
+
+#include "bench.h"
+
+#define BENCH_FRAME_MAX		(CONFIG_BT_L2CAP_TX_MTU - 3)
+
+enum {
+	BENCH_RUN,
+	BENCH_STOP,
+	BENCH_PING,
+};
+
+/* Only one central is benchmarked at a time */
+static struct bt_conn *bench_conn;
+static atomic_t bench_flags;
+static u16_t bench_payload_len;
+static u32_t bench_duration_ms;
+static u16_t bench_ping_seq;
+/* PING time as received, it is echoed untouched */
+static u32_t bench_ping_time;
+static u32_t bench_ping_rx_us;
+
+static K_SEM_DEFINE(bench_sem, 0, 1);
+
+static struct bt_conn *bench_conn_get(void)
+{
+	struct bt_conn *conn = NULL;
+	unsigned int key;
+
+	key = irq_lock();
+	if (bench_conn) {
+		conn = bt_conn_ref(bench_conn);
+	}
+	irq_unlock(key);
+
+	return conn;
+}
+
+/* Bind the benchmark to the first central that talks to it */
+static bool bench_conn_claim(struct bt_conn *conn)
+{
+	bool ok = true;
+	unsigned int key;
+
+	key = irq_lock();
+	if (!bench_conn) {
+		bench_conn = bt_conn_ref(conn);
+	} else if (bench_conn != conn) {
+		ok = false;
+	}
+	irq_unlock(key);
+
+	return ok;
+}
+
+bool bench_rx(struct bt_conn *conn, const void *data, u16_t len)
+{
+	u32_t now = nus_bench_time_us();
+	const struct nus_bench_start *start = data;
+	const struct nus_bench_hdr *hdr = data;
+	u8_t type = nus_bench_type(data, len);
+
+	if (!type) {
+		return false;
+	}
+
+	if (!bench_conn_claim(conn)) {
+		printk("Benchmark busy with another central\n");
+		return true;
+	}
+
+	switch (type) {
+	case NUS_BENCH_PING:
+		bench_ping_seq = sys_le16_to_cpu(hdr->seq);
+		bench_ping_time = hdr->time_us;
+		bench_ping_rx_us = now;
+		atomic_set_bit(&bench_flags, BENCH_PING);
+		break;
+	case NUS_BENCH_START:
+		if (len < sizeof(*start) ||
+		    atomic_test_bit(&bench_flags, BENCH_RUN)) {
+			return true;
+		}
+
+		bench_payload_len = sys_le16_to_cpu(start->payload_len);
+		bench_duration_ms = sys_le32_to_cpu(start->duration_ms);
+		atomic_clear_bit(&bench_flags, BENCH_STOP);
+		atomic_set_bit(&bench_flags, BENCH_RUN);
+		break;
+	case NUS_BENCH_STOP:
+		atomic_set_bit(&bench_flags, BENCH_STOP);
+		break;
+	default:
+		return true;
+	}
+
+	k_sem_give(&bench_sem);
+
+	return true;
+}
+
+static void bench_pong(struct bt_conn *conn)
+{
+	struct nus_bench_pong pong;
+
+	if (!atomic_test_and_clear_bit(&bench_flags, BENCH_PING)) {
+		return;
+	}
+
+	pong.ping_time_us = bench_ping_time;
+	pong.rx_time_us = sys_cpu_to_le32(bench_ping_rx_us);
+	/* Stamped last, as close to the send as possible */
+	nus_bench_hdr_init(&pong.hdr, NUS_BENCH_PONG, bench_ping_seq);
+
+	nus_send(conn, &pong, sizeof(pong));
+}
+
+static void bench_stream(struct bt_conn *conn)
+{
+	u8_t frame[BENCH_FRAME_MAX];
+	struct nus_bench_done done;
+	u32_t start = k_uptime_get_32();
+	u32_t frames = 0;
+	u32_t bytes = 0;
+	u16_t len;
+	s32_t ret;
+	int i;
+
+	len = min(bench_payload_len, nus_get_payload_len(conn));
+	len = max(len, sizeof(struct nus_bench_hdr));
+
+	for (i = 0; i < len; i++) {
+		frame[i] = 'A' + i % 26;
+	}
+
+	printk("Benchmark: %u byte frames for %u ms\n", len, bench_duration_ms);
+
+	while (k_uptime_get_32() - start < bench_duration_ms &&
+	       !atomic_test_bit(&bench_flags, BENCH_STOP)) {
+		bench_pong(conn);
+
+		nus_bench_hdr_init((struct nus_bench_hdr *)frame,
+				   NUS_BENCH_DATA, frames);
+
+		ret = nus_send(conn, frame, len);
+		if (ret == -ENOMEM) {
+			/* Out of TX buffers, let the host catch up */
+			k_sleep(K_MSEC(1));
+			continue;
+		}
+
+		if (ret != len) {
+			printk("Benchmark: send failed (err %d)\n", ret);
+			break;
+		}
+
+		frames++;
+		bytes += len;
+	}
+
+	done.frames = sys_cpu_to_le32(frames);
+	done.bytes = sys_cpu_to_le32(bytes);
+	nus_bench_hdr_init(&done.hdr, NUS_BENCH_DONE, 0);
+
+	for (i = 0; i < 10; i++) {
+		if (nus_send(conn, &done, sizeof(done)) == sizeof(done)) {
+			break;
+		}
+
+		k_sleep(K_MSEC(10));
+	}
+
+	printk("Benchmark: sent %u frames, %u bytes\n", frames, bytes);
+
+	atomic_clear_bit(&bench_flags, BENCH_RUN);
+}
+
+static void bench_thread(void *p1, void *p2, void *p3)
+{
+	struct bt_conn *conn;
+
+	while (1) {
+		k_sem_take(&bench_sem, K_FOREVER);
+
+		conn = bench_conn_get();
+		if (!conn) {
+			atomic_clear(&bench_flags);
+			continue;
+		}
+
+		bench_pong(conn);
+
+		if (atomic_test_bit(&bench_flags, BENCH_RUN)) {
+			bench_stream(conn);
+		}
+
+		bt_conn_unref(conn);
+	}
+}
+
+K_THREAD_DEFINE(bench_tid, 1536, bench_thread, NULL, NULL, NULL,
+		K_PRIO_PREEMPT(8), 0, K_NO_WAIT);
+
+static void bench_disconnected(struct bt_conn *conn, u8_t reason)
+{
+	struct bt_conn *old = NULL;
+	unsigned int key;
+
+	key = irq_lock();
+	if (bench_conn == conn) {
+		old = bench_conn;
+		bench_conn = NULL;
+	}
+	irq_unlock(key);
+
+	if (old) {
+		atomic_set_bit(&bench_flags, BENCH_STOP);
+		bt_conn_unref(old);
+	}
+}
+
+static struct bt_conn_cb bench_conn_callbacks = {
+	.disconnected = bench_disconnected,
+};
+
+void bench_init(void)
+{
+	bt_conn_cb_register(&bench_conn_callbacks);
+}
+
+#endif /* CONFIG_NUS_BENCH */
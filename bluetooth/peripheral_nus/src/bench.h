@@ -0,0 +1,24 @@
+/** @file
+ *  @brief Nordic NUS peripheral benchmark responder
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <bluetooth/conn.h>
+
+/**@brief   Register the connection callbacks of the responder. */
+void bench_init(void);
+
+/**@brief   Handle data written to NUS RX.
+ *
+ * @return  true if it was a benchmark frame and has been consumed.
+ */
+bool bench_rx(struct bt_conn *conn, const void *data, u16_t len);
+
+#endif /* __BENCH_H */
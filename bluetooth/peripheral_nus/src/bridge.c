@@ -0,0 +1,251 @@
+/** @file
+ *  @brief NUS to UART bridge
+ *
+ *  Forwards everything received on a UART to the subscribed NUS peers and
+ *  everything written to NUS RX out of the UART, in NUS pool buffers and
+ *  without copying the data in between.
+ *
+ *  UART RX is read in FIFO sized bursts from the interrupt into a pool
+ *  buffer. A full buffer is handed to the bridge thread, which queues it to
+ *  NUS, while the interrupt fills the next one; a partial one is handed
+ *  over once the line has been idle for CONFIG_NUS_BRIDGE_IDLE_MS. When the
+ *  pool runs dry, reading stops so that the UART hardware flow control
+ *  holds the sender off.
+ *
+ *  NUS RX buffers are queued by reference and fed to the UART by the TX
+ *  interrupt, a FIFO worth at a time.
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#if defined(CONFIG_NUS_BRIDGE)
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <misc/printk.h>
+#include <zephyr.h>
+#include <device.h>
+#include <uart.h>
+#include <atomic.h>
+#include <net/buf.h>
+
+#include <gatt/nus.h>
+#include <gatt/nus_log.h>
+
+#include "bridge.h"
+
+static struct device *uart_dev;
+
+/* Buffer the interrupt is reading into, allocated on demand */
+static struct net_buf *rx_cur;
+/* Filled buffers on their way to NUS */
+static K_FIFO_DEFINE(rx_fifo);
+/* Set while reading is paused for lack of a free buffer */
+static atomic_t rx_paused;
+/* Bytes read so far, lets the thread tell an idle line */
+static u32_t rx_count;
+static u32_t rx_dropped;
+
+/* NUS RX buffers waiting for the UART, and how much of the one being sent
+ * is out. The buffers are shared with NUS and never modified.
+ */
+static K_FIFO_DEFINE(tx_fifo);
+static struct net_buf *tx_cur;
+static u16_t tx_off;
+
+static void bridge_rts_set(bool on)
+{
+#if defined(CONFIG_UART_LINE_CTRL)
+	/* Drivers doing flow control in hardware do not need this */
+	uart_line_ctrl_set(uart_dev, LINE_CTRL_RTS, on);
+#endif
+}
+
+/* Hand the buffer being filled to the thread, interrupts locked */
+static void bridge_rx_flush(void)
+{
+	net_buf_put(&rx_fifo, rx_cur);
+	rx_cur = NULL;
+}
+
+static void bridge_rx_isr(struct device *dev)
+{
+	int n;
+
+	while (1) {
+		if (!rx_cur) {
+			rx_cur = nus_buf_alloc(K_NO_WAIT);
+			if (!rx_cur) {
+				/* Leave the rest in the FIFO, flow control
+				 * kicks in
+				 */
+				uart_irq_rx_disable(dev);
+				bridge_rts_set(false);
+				atomic_set(&rx_paused, 1);
+				return;
+			}
+		}
+
+		n = uart_fifo_read(dev, net_buf_tail(rx_cur),
+				   net_buf_tailroom(rx_cur));
+		if (n <= 0) {
+			return;
+		}
+
+		net_buf_add(rx_cur, n);
+		rx_count += n;
+
+		if (!net_buf_tailroom(rx_cur)) {
+			bridge_rx_flush();
+		}
+	}
+}
+
+static void bridge_tx_isr(struct device *dev)
+{
+	int n;
+
+	while (1) {
+		if (!tx_cur) {
+			tx_cur = net_buf_get(&tx_fifo, K_NO_WAIT);
+			if (!tx_cur) {
+				uart_irq_tx_disable(dev);
+				return;
+			}
+
+			tx_off = 0;
+		}
+
+		n = uart_fifo_fill(dev, tx_cur->data + tx_off,
+				   tx_cur->len - tx_off);
+		if (n <= 0) {
+			return;
+		}
+
+		tx_off += n;
+		if (tx_off == tx_cur->len) {
+			net_buf_unref(tx_cur);
+			tx_cur = NULL;
+		}
+	}
+}
+
+static void bridge_isr(struct device *dev)
+{
+	while (uart_irq_update(dev) && uart_irq_is_pending(dev)) {
+		if (uart_irq_rx_ready(dev)) {
+			bridge_rx_isr(dev);
+		}
+
+		if (uart_irq_tx_ready(dev)) {
+			bridge_tx_isr(dev);
+		}
+	}
+}
+
+void bridge_write(struct net_buf *buf)
+{
+	if (!uart_dev || !buf || !buf->len) {
+		return;
+	}
+
+	/* NUS keeps its own reference, the UART takes another */
+	net_buf_put(&tx_fifo, net_buf_ref(buf));
+
+	uart_irq_tx_enable(uart_dev);
+}
+
+/* Queue a received buffer to NUS, waiting while the TX queues are full */
+static void bridge_rx_send(struct net_buf *buf)
+{
+	s32_t err;
+
+	while (1) {
+		err = nus_tx_enqueue_buf(NULL, buf);
+		if (err != -ENOMEM) {
+			break;
+		}
+
+		k_sleep(K_MSEC(1));
+	}
+
+	if (err) {
+		/* Nobody to send to, do not stall the UART */
+		rx_dropped += buf->len;
+		NUS_LOG_RATELIMIT(DATA, WRN, "no NUS peer, %u UART bytes dropped",
+				  rx_dropped);
+	}
+
+	net_buf_unref(buf);
+}
+
+/* Read again once buffers may have come back to the pool */
+static void bridge_rx_resume(void)
+{
+	if (!atomic_cas(&rx_paused, 1, 0)) {
+		return;
+	}
+
+	bridge_rts_set(true);
+	uart_irq_rx_enable(uart_dev);
+}
+
+static void bridge_thread(void *p1, void *p2, void *p3)
+{
+	struct net_buf *buf;
+	u32_t last_count = 0;
+	unsigned int key;
+
+	while (1) {
+		buf = net_buf_get(&rx_fifo, K_MSEC(CONFIG_NUS_BRIDGE_IDLE_MS));
+		if (buf) {
+			bridge_rx_send(buf);
+			bridge_rx_resume();
+			continue;
+		}
+
+		/* Idle line: flush a partial buffer once nothing has arrived
+		 * for a whole period.
+		 */
+		key = irq_lock();
+		if (rx_count == last_count && rx_cur && rx_cur->len) {
+			bridge_rx_flush();
+		}
+		last_count = rx_count;
+		irq_unlock(key);
+
+		/* The pool may also refill as NUS sends queued buffers */
+		bridge_rx_resume();
+	}
+}
+
+K_THREAD_DEFINE(bridge_tid, CONFIG_NUS_BRIDGE_STACK_SIZE, bridge_thread,
+		NULL, NULL, NULL, CONFIG_NUS_BRIDGE_PRIO, 0, K_NO_WAIT);
+
+int bridge_init(void)
+{
+	uart_dev = device_get_binding(CONFIG_NUS_BRIDGE_UART_NAME);
+	if (!uart_dev) {
+		printk("UART %s not found\n", CONFIG_NUS_BRIDGE_UART_NAME);
+		return -ENODEV;
+	}
+
+	uart_irq_rx_disable(uart_dev);
+	uart_irq_tx_disable(uart_dev);
+	uart_irq_callback_set(uart_dev, bridge_isr);
+
+	bridge_rts_set(true);
+	uart_irq_rx_enable(uart_dev);
+
+	printk("Bridging NUS to %s\n", CONFIG_NUS_BRIDGE_UART_NAME);
+
+	return 0;
+}
+
+#endif /* CONFIG_NUS_BRIDGE */
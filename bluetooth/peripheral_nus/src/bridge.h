@@ -0,0 +1,28 @@
+/** @file
+ *  @brief NUS to UART bridge
+ */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __BRIDGE_H
+#define __BRIDGE_H
+
+#include <zephyr/types.h>
+#include <net/buf.h>
+
+/**@brief   Bind CONFIG_NUS_BRIDGE_UART_NAME and start bridging. */
+int bridge_init(void);
+
+/**@brief   Queue a NUS RX buffer for UART TX.
+ *
+ * @details Called from the NUS data handler with the pool buffer of the
+ *          write, which is referenced until it has been sent. While the
+ *          UART holds on to buffers the pool drains and further writes are
+ *          refused, which pushes back on the peer.
+ */
+void bridge_write(struct net_buf *buf);
+
+#endif /* __BRIDGE_H */
@@ -18,8 +18,23 @@
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
+#if defined(CONFIG_BT_SETTINGS)
+#include <settings/settings.h>
+#endif
 
 #include <gatt/nus.h>
+#include <gatt/nus_log.h>
+
+#if defined(CONFIG_NUS_BENCH)
+#include "bench.h"
+#endif
+#if defined(CONFIG_NUS_BRIDGE)
+#include "bridge.h"
+#endif
+#if defined(CONFIG_NUS_FRAME)
+#include <net/buf.h>
+#include <gatt/nus_frame.h>
+#endif
 
 /* AUTH_NUMERIC_COMPARISON result in in LESC Numeric Comparison authentication
  * Undefine this result in LESC Passkey Input
@@ -29,14 +44,41 @@
 #define DEVICE_NAME		    CONFIG_BT_DEVICE_NAME
 #define DEVICE_NAME_LEN		(sizeof(DEVICE_NAME) - 1)
 
-struct bt_conn *default_conn;
-/** Start security procedure from Peripheral to NUS Central on nRF5 or SmartPhone */
-/** BT_SECURITY_LOW(1)     No encryption and no authentication. */
-/** BT_SECURITY_MEDIUM(2)  Encryption and no authentication (no MITM). */
-/** BT_SECURITY_HIGH(3)    Encryption and authentication (MITM). */
-/** BT_SECURITY_FIPS(4)    Authenticated Secure Connections !!CURRENTLY NOT USABLE!!*/
-#define BT_SECURITY     BT_SECURITY_FIPS
-bt_security_t           g_level = BT_SECURITY_NONE;
+/* Size of each chunk handed to the NUS TX queue */
+#define NUS_TX_BUF_LEN		128
+/* Delay between two chunks */
+#define NUS_TX_INTERVAL		K_MSEC(100)
+/* Framed records grow up to this length, several notifications long */
+#define NUS_FRAME_RECORD_MAX	600
+
+/* The demo data is produced from the system work queue, and only while a
+ * link is ready: NUS reports readiness as soon as a link is connected,
+ * secured and subscribed, so the first chunk is queued right then, and
+ * nothing runs at all while no central listens.
+ */
+static struct k_delayed_work tx_work;
+static int tx_index;
+/* Producer runs, and how many of them found no link ready, counted since
+ * tx_wakeups_since
+ */
+static u32_t tx_wakeups;
+static u32_t tx_idle_wakeups;
+static u32_t tx_wakeups_since;
+
+/* Links served at the same time. NUS itself starts the security procedure
+ * for CONFIG_NUS_SECURITY_LEVEL and holds data back until it completes.
+ */
+static struct bt_conn *conns[CONFIG_BT_MAX_CONN];
+
+#if defined(CONFIG_NUS_FRAME)
+/* Framing state of each link, indexed like conns. Links are set up in the
+ * BT RX thread and records sent from the system work queue, both
+ * cooperative, so neither preempts the other.
+ */
+static struct nus_frame_tx frame_tx[CONFIG_BT_MAX_CONN];
+static struct nus_frame_rx frame_rx[CONFIG_BT_MAX_CONN];
+static bool frame_ready[CONFIG_BT_MAX_CONN];
+#endif
 
 static const struct bt_data ad[] = {
 	BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
@@ -47,29 +89,86 @@ static const struct bt_data sd[] = {
 	BT_DATA(BT_DATA_NAME_COMPLETE, DEVICE_NAME, DEVICE_NAME_LEN),
 };
 
+static int conn_slot(struct bt_conn *conn)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(conns); i++) {
+		if (conns[i] == conn) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void advertise(void)
+{
+	int err;
+
+	err = bt_le_adv_start(BT_LE_ADV_CONN, ad, ARRAY_SIZE(ad),
+			      sd, ARRAY_SIZE(sd));
+	if (err && err != -EALREADY) {
+		printk("Advertising failed to start (err %d)\n", err);
+		return;
+	}
+
+	printk("Advertising successfully started\n");
+}
+
 static void connected(struct bt_conn *conn, u8_t err)
 {
+	int slot;
+
 	if (err) {
 		printk("Connection failed (err %u)\n", err);
-	} 
+		return;
+	}
+
+	slot = conn_slot(NULL);
+	if (slot < 0) {
+		printk("No free connection slot\n");
+		return;
+	}
 
-  default_conn = bt_conn_ref(conn);
+	conns[slot] = bt_conn_ref(conn);
 	printk("Connected\n");
 
-  int ret = bt_conn_security(default_conn, BT_SECURITY);
-  if (ret) {
-		printk("Failed to set security (err %d)\n", ret);
+#if defined(CONFIG_NUS_FRAME)
+	nus_frame_tx_init(&frame_tx[slot]);
+	nus_frame_rx_init(&frame_rx[slot]);
+	frame_ready[slot] = false;
+#endif
+
+	/* Advertising stops on connection, keep accepting more peers */
+	if (conn_slot(NULL) >= 0) {
+		advertise();
 	}
 }
 
 static void disconnected(struct bt_conn *conn, u8_t reason)
 {
+	int slot = conn_slot(conn);
+
 	printk("Disconnected (reason %u)\n", reason);
 
-	if (default_conn) {
-		bt_conn_unref(default_conn);
-		default_conn = NULL;
+	if (slot < 0) {
+		return;
 	}
+
+#if defined(CONFIG_NUS_FRAME)
+	printk("Link %d: %u records, %u gaps, %u dropped, %u CRC errors\n",
+	       slot, frame_rx[slot].messages, frame_rx[slot].gaps,
+	       frame_rx[slot].dropped, frame_rx[slot].crc_errors);
+	/* Releases a partial message */
+	nus_frame_rx_init(&frame_rx[slot]);
+	frame_ready[slot] = false;
+#endif
+
+	bt_conn_unref(conns[slot]);
+	conns[slot] = NULL;
+
+	advertise();
 }
 
 #if defined(CONFIG_BT_SMP)
@@ -92,7 +191,6 @@ static void security_changed(struct bt_conn *conn, bt_security_t level)
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
 	printk("Security changed: %s level %u\n", addr, level);
-	g_level = level;
 }
 #endif /* defined(CONFIG_BT_SMP) */
 
@@ -107,16 +205,220 @@ static struct bt_conn_cb conn_callbacks = {
 #endif /* defined(CONFIG_BT_SMP) */
 };
 
+#if defined(CONFIG_NUS_FRAME)
+static void frame_msg(void *user_data, struct net_buf *msg, u16_t len)
+{
+	NUS_LOG(DATA, DBG, "link %d record of %u bytes",
+		POINTER_TO_INT(user_data), len);
+}
+
+/* Reassemble the records of the central, chaining the pool buffers the
+ * writes arrived in
+ */
+static void frame_rx_data(ble_nus_data_evt_t *p_evt)
+{
+	struct net_buf *buf = p_evt->rx_data.buf;
+	int slot = conn_slot(p_evt->conn);
+
+	if (slot < 0) {
+		return;
+	}
+
+#if defined(CONFIG_NUS_RX_READ)
+	/* NUS keeps the buffer for reading RX back, reassembly would pull
+	 * the header off it and chain it
+	 */
+	buf = NULL;
+#endif
+
+	if (buf) {
+		buf = net_buf_ref(buf);
+	} else {
+		/* Copy it once. If the pool is empty the gap shows in the
+		 * sequence numbers.
+		 */
+		buf = nus_buf_alloc(K_NO_WAIT);
+		if (!buf) {
+			return;
+		}
+
+		net_buf_add_mem(buf, p_evt->rx_data.p_data,
+				min(p_evt->rx_data.length,
+				    net_buf_tailroom(buf)));
+	}
+
+	if (nus_frame_rx_buf(&frame_rx[slot], buf, frame_msg,
+			     INT_TO_POINTER(slot))) {
+		NUS_LOG_RATELIMIT(DATA, WRN, "link %d malformed fragment", slot);
+	}
+}
+#endif
+
 static void nus_data_handler(ble_nus_data_evt_t * p_evt)
 {
-   printk("NUS data received, len: %d, data: %c\n", 
+#if defined(CONFIG_NUS_BENCH)
+   if (bench_rx(p_evt->conn, p_evt->rx_data.p_data, p_evt->rx_data.length)) {
+     return;
+   }
+#endif
+#if defined(CONFIG_NUS_BRIDGE)
+   bridge_write(p_evt->rx_data.buf);
+#endif
+#if defined(CONFIG_NUS_FRAME)
+   frame_rx_data(p_evt);
+#endif
+   NUS_LOG(DATA, DBG, "NUS data received, len: %d, data: %c",
      p_evt->rx_data.length, *(p_evt->rx_data.p_data));
 }
 
+static void nus_payload_len_handler(struct bt_conn *conn, u16_t payload_len)
+{
+   printk("NUS payload size %u\n", payload_len);
+}
+
+static void nus_link_handler(struct bt_conn *conn, u16_t interval,
+			     u16_t latency, u16_t timeout)
+{
+   printk("NUS link interval %u latency %u timeout %u\n",
+     interval, latency, timeout);
+}
+
+/* Rate of count since the producer counters were reset */
+static u32_t tx_per_minute(u32_t count)
+{
+	u32_t elapsed = k_uptime_get_32() - tx_wakeups_since;
+
+	if (!elapsed) {
+		return count;
+	}
+
+	return (u64_t)count * 60 * MSEC_PER_SEC / elapsed;
+}
+
+static void nus_ready_handler(struct bt_conn *conn, u32_t connect_to_ready_ms)
+{
+#if defined(CONFIG_NUS_FRAME)
+   int slot = conn_slot(conn);
+
+   if (slot >= 0) {
+     frame_ready[slot] = true;
+   }
+
+#endif
+   printk("NUS ready %u ms after connect, %u producer wakeups per minute, "
+     "%u of them idle\n", connect_to_ready_ms, tx_per_minute(tx_wakeups),
+     tx_per_minute(tx_idle_wakeups));
+
+#if !defined(CONFIG_NUS_BENCH) && !defined(CONFIG_NUS_BRIDGE)
+   /* Start producing now rather than at the next tick */
+   k_delayed_work_submit(&tx_work, K_NO_WAIT);
+#endif
+}
+
+#if defined(CONFIG_NUS_FRAME)
+/* Queue one fragment in a pool buffer of its own, so that it goes out as a
+ * single notification. A fragment queued before the central switched on
+ * compression no longer fits, NUS drops it and the central sees a gap.
+ */
+static s32_t frame_out(void *user_data, const u8_t *data, u16_t len)
+{
+	struct net_buf *buf;
+	s32_t err;
+
+	buf = nus_buf_alloc(K_NO_WAIT);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	net_buf_add_mem(buf, data, len);
+	err = nus_tx_enqueue_pdu(user_data, buf);
+	net_buf_unref(buf);
+
+	return err;
+}
+
+/* Send the same record to every ready link, framed for each of them. The
+ * records start with their index and grow up to NUS_FRAME_RECORD_MAX.
+ */
+static void frame_tx_records(void)
+{
+	static u8_t record[NUS_FRAME_RECORD_MAX];
+	u16_t len, frag_len;
+	s32_t err;
+	int i;
+
+	len = sizeof(u32_t) + tx_index % (sizeof(record) - sizeof(u32_t));
+
+	sys_put_le32(tx_index, record);
+	for (i = sizeof(u32_t); i < len; i++) {
+		record[i] = 'A' + (tx_index + i) % 26;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(conns); i++) {
+		if (!conns[i] || !frame_ready[i]) {
+			continue;
+		}
+
+		frag_len = min(nus_tx_data_len(conns[i]), CONFIG_NUS_BUF_SIZE);
+
+		/* A record cut short is dropped by the central */
+		err = nus_frame_send(&frame_tx[i], record, len, true, frag_len,
+				     frame_out, conns[i]);
+		if (err) {
+			NUS_LOG_RATELIMIT(DATA, WRN,
+					  "link %d record %d not sent (err %d)",
+					  i, tx_index, err);
+		}
+	}
+
+	tx_index++;
+}
+#endif
+
+static void tx_work_handler(struct k_work *work)
+{
+#if !defined(CONFIG_NUS_FRAME)
+	u8_t tx_buf[NUS_TX_BUF_LEN];
+	int i;
+#endif
+
+	tx_wakeups++;
+
+	/* The last link went away, wait for the next ready event */
+	if (!nus_ready_count()) {
+		tx_idle_wakeups++;
+		return;
+	}
+
+#if defined(CONFIG_NUS_FRAME)
+	frame_tx_records();
+#else
+	for (i = 0; i < sizeof(tx_buf); i++) {
+		tx_buf[i] = 'A' + (tx_index + i) % 26;
+	}
+
+	/* Fan out to every subscribed and secured peer. The NUS TX queue
+	 * sends it from its own thread, so this never waits for the radio.
+	 */
+	tx_index += nus_tx_enqueue(NULL, tx_buf, sizeof(tx_buf));
+#endif
+
+	k_delayed_work_submit(&tx_work, NUS_TX_INTERVAL);
+}
+
 static void bt_ready(int err)
 {
     ble_nus_init_t init = {
-      .data_handler = nus_data_handler
+      .data_handler = nus_data_handler,
+      .payload_len_handler = nus_payload_len_handler,
+#if defined(CONFIG_NUS_BENCH)
+      /* The benchmark central sweeps the connection interval itself */
+      .link_profile = NUS_LINK_PROFILE_NONE,
+#else
+      .link_profile = NUS_LINK_PROFILE_BULK,
+#endif
+      .link_handler = nus_link_handler,
+      .ready_handler = nus_ready_handler
     };
      
 	if (err) {
@@ -126,20 +428,18 @@ static void bt_ready(int err)
 
 	printk("Bluetooth initialized\n");
 
+#if defined(CONFIG_BT_SETTINGS)
+	/* Restore bonds (and their CCC state) before anyone connects */
+	settings_load();
+#endif
+
 	err = nus_init(&init);
 	if (err) {
 		printk("NUS failed to init (err %d)\n", err);
 		return;
 	}
 
-	err = bt_le_adv_start(BT_LE_ADV_CONN, ad, ARRAY_SIZE(ad),
-			      sd, ARRAY_SIZE(sd));
-	if (err) {
-		printk("Advertising failed to start (err %d)\n", err);
-		return;
-	}
-
-	printk("Advertising successfully started\n");
+	advertise();
 }
 
 static void auth_cancel(struct bt_conn *conn)
@@ -159,7 +459,7 @@ static void auth_pairing_confirm(struct bt_conn *conn)
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 	printk("Pairing Confirm for %s\n", addr);
-  if (conn == default_conn)
+  if (conn_slot(conn) >= 0)
   {
     err = bt_conn_auth_pairing_confirm(conn);
   	if (err) {
@@ -189,7 +489,7 @@ static void auth_passkey_confirm(struct bt_conn *conn, unsigned int passkey)
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 	printk("Passkey Confirm for %s: %06u\n", addr, passkey);
-  if (conn == default_conn)
+  if (conn_slot(conn) >= 0)
   {
     err = bt_conn_auth_passkey_confirm(conn);
   	if (err) {
@@ -229,8 +529,9 @@ static struct bt_conn_auth_cb auth_cb_display_only = {
 void main(void)
 {
 	int err;
-	char tx_char;
-	int tx_index = 0;
+
+	tx_wakeups_since = k_uptime_get_32();
+	k_delayed_work_init(&tx_work, tx_work_handler);
 
 	err = bt_enable(bt_ready);
 	if (err) {
@@ -244,18 +545,14 @@ void main(void)
 #else
 	bt_conn_auth_cb_register(&auth_cb_display_only);
 #endif
-	/* Implement notification. At the moment there is no suitable way
-	 * of starting delayed work so we do it here
-	 */
-	while (1) {
-		k_sleep(MSEC_PER_SEC);
-
-    tx_char = 'A' + tx_index%26;
-		/* Send NUS notifications */
-		if (g_level == BT_SECURITY && nus_notify(default_conn, tx_char) == 0)
-		{
-		   printk("NUS sent %c\n", tx_char);
-		   tx_index++;
-		}
-	}
+
+#if defined(CONFIG_NUS_BENCH)
+	/* The benchmark streams on its own once a central asks for it */
+	bench_init();
+#elif defined(CONFIG_NUS_BRIDGE)
+	/* The UART is the data source instead of the demo pattern */
+	bridge_init();
+#endif
+
+	/* Everything else happens in callbacks and the work queue */
 }